@@ -0,0 +1,83 @@
+"""
+bench_gil.py: time zero-timeout waits under GIL contention.
+
+The main thread makes back to back select(), poll() and epoll.poll() calls
+with a zero timeout while other threads spin in pure Python.  Each call is
+timed once with the GIL released around the wait, as before, and once with
+the GIL kept (set_gil_threshold(0), the default).  With the GIL released
+every call has to queue behind the busy threads to get it back.
+
+    make bench_gil
+    python bench/bench_gil.py [threads] [seconds]
+"""
+import os
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), os.pardir))
+import select_backport as select
+
+
+def spin(stop):
+    n = 0
+    while not stop:
+        n += 1
+
+
+def rate(call, seconds):
+    n = 0
+    start = time.time()
+    deadline = start + seconds
+    while True:
+        for i in xrange(100):
+            call()
+        n += 100
+        now = time.time()
+        if now >= deadline:
+            return n / (now - start)
+
+
+def main():
+    nthreads = int(sys.argv[1]) if len(sys.argv) > 1 else 2
+    seconds = float(sys.argv[2]) if len(sys.argv) > 2 else 1.0
+
+    rfd, wfd = os.pipe()
+    p = select.poll()
+    p.register(rfd, select.POLLIN)
+    calls = [("select", lambda: select.select([rfd], [], [], 0)),
+             ("poll", lambda: p.poll(0))]
+    if hasattr(select, "epoll"):
+        ep = select.epoll()
+        ep.register(rfd, select.EPOLLIN)
+        calls.append(("epoll", lambda: ep.poll(0)))
+
+    stop = []
+    threads = [threading.Thread(target=spin, args=(stop,))
+               for i in range(nthreads)]
+    for t in threads:
+        t.daemon = True
+        t.start()
+
+    print "%d busy threads, calls/s" % nthreads
+    print "%-8s %12s %12s %8s" % ("", "release", "keep", "ratio")
+    old = select.set_gil_threshold(0)
+    try:
+        for name, call in calls:
+            select.set_gil_threshold(-1)
+            released = rate(call, seconds)
+            select.set_gil_threshold(0)
+            kept = rate(call, seconds)
+            print "%-8s %12.0f %12.0f %7.1fx" % (name, released, kept,
+                                                 kept / released)
+    finally:
+        select.set_gil_threshold(old)
+        stop.append(True)
+        for t in threads:
+            t.join()
+        os.close(rfd)
+        os.close(wfd)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,88 @@
+/**
+ * bench_pollscan.c: time the revents scan routines of pollscan.h.
+ *
+ * Each run fills a pollfd array with a given fraction of entries that have
+ * revents set, spread at random, and reports the average time per scan
+ * for every routine the CPU supports.
+ *
+ *   make bench
+ *   ./bench/bench_pollscan
+ */
+#define HAVE_POLL_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../pollscan.h"
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+fill(struct pollfd *ufds, int n, double ratio)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        ufds[i].fd = i;
+        ufds[i].events = POLLIN;
+        ufds[i].revents = (rand() < ratio * RAND_MAX) ? POLLIN : 0;
+    }
+}
+
+int
+main(void)
+{
+    static const int sizes[] = {1000, 10000, 50000};
+    static const double ratios[] = {0.0, 0.001, 0.01, 0.1, 0.5};
+    struct pollfd *ufds;
+    int *ready;
+    int s, r, i, iter, k, iters, expect;
+    double t;
+
+    pollscan_init();
+    printf("%-8s %8s %8s %10s\n", "scan", "entries", "ready", "ns/scan");
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        ufds = malloc(sizes[s] * sizeof(struct pollfd));
+        ready = malloc(sizes[s] * sizeof(int));
+        if (ufds == NULL || ready == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        iters = 20000000 / sizes[s];
+        for (r = 0; r < (int)(sizeof(ratios) / sizeof(ratios[0])); r++) {
+            srand(1);
+            fill(ufds, sizes[s], ratios[r]);
+            expect = pollscan_scalar(ufds, sizes[s], ready, sizes[s]);
+            for (i = 0; pollscan_impls[i].name != NULL; i++) {
+                if (pollscan_impls[i].func == NULL)
+                    continue;
+                t = now();
+                for (iter = 0; iter < iters; iter++) {
+                    /* pass the whole array as the limit, as poll() does
+                       when poll(2) returns the worst case */
+                    k = pollscan_impls[i].func(ufds, sizes[s], ready,
+                                               sizes[s]);
+                    if (k != expect) {
+                        fprintf(stderr, "%s: %d entries, expected %d\n",
+                                pollscan_impls[i].name, k, expect);
+                        return 1;
+                    }
+                }
+                t = now() - t;
+                printf("%-8s %8d %8d %10.0f\n", pollscan_impls[i].name,
+                       sizes[s], expect, t / iters * 1e9);
+            }
+        }
+        free(ufds);
+        free(ready);
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+/**
+ * pollscan.h: find the entries of a pollfd array with non-zero revents.
+ *
+ * Shared by select_backportmodule.c and bench/bench_pollscan.c.  poll(2)
+ * usually reports a handful of descriptors out of many; the vector
+ * versions test 8 (SSE2) or 16 (AVX2) entries at once and only look at
+ * the entries of a block that has something set.  The implementation is
+ * picked at runtime by pollscan_init().
+ */
+#ifndef _POLLSCAN__H__
+#define _POLLSCAN__H__ 1
+
+#include <string.h>
+
+#if defined(HAVE_POLL_H)
+#include <poll.h>
+#elif defined(HAVE_SYS_POLL_H)
+#include <sys/poll.h>
+#endif
+
+/* Store the indices of the entries of ufds[0..n) with non-zero revents in
+   ready, in ascending order, stopping after max of them.  Returns the
+   number of indices stored. */
+typedef int (*pollscan_func)(const struct pollfd *ufds, int n,
+                             int *ready, int max);
+
+static int
+pollscan_scalar(const struct pollfd *ufds, int n, int *ready, int max)
+{
+    int i, k = 0;
+
+    for (i = 0; i < n && k < max; i++) {
+        if (ufds[i].revents)
+            ready[k++] = i;
+    }
+    return k;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define POLLSCAN_X86 1
+#include <immintrin.h>
+
+/* struct pollfd is {int fd; short events; short revents;}: revents is the
+   top 16 bits of every 64 bit lane. */
+
+__attribute__((target("sse2")))
+static int
+pollscan_sse2(const struct pollfd *ufds, int n, int *ready, int max)
+{
+    const __m128i mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v;
+    int i = 0, j, k = 0;
+
+    for (; i + 8 <= n && k < max; i += 8) {
+        const __m128i *p = (const __m128i *)(ufds + i);
+        v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p),
+                                      _mm_loadu_si128(p + 1)),
+                         _mm_or_si128(_mm_loadu_si128(p + 2),
+                                      _mm_loadu_si128(p + 3)));
+        v = _mm_and_si128(v, mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)) == 0xffff)
+            continue;
+        for (j = i; j < i + 8 && k < max; j++) {
+            if (ufds[j].revents)
+                ready[k++] = j;
+        }
+    }
+    for (; i < n && k < max; i++) {
+        if (ufds[i].revents)
+            ready[k++] = i;
+    }
+    return k;
+}
+
+__attribute__((target("avx2")))
+static int
+pollscan_avx2(const struct pollfd *ufds, int n, int *ready, int max)
+{
+    const __m256i mask = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0,
+                                          -1, 0, 0, 0, -1, 0, 0, 0);
+    __m256i v;
+    int i = 0, j, k = 0;
+
+    for (; i + 16 <= n && k < max; i += 16) {
+        const __m256i *p = (const __m256i *)(ufds + i);
+        v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p),
+                                            _mm256_loadu_si256(p + 1)),
+                            _mm256_or_si256(_mm256_loadu_si256(p + 2),
+                                            _mm256_loadu_si256(p + 3)));
+        if (_mm256_testz_si256(v, mask))
+            continue;
+        for (j = i; j < i + 16 && k < max; j++) {
+            if (ufds[j].revents)
+                ready[k++] = j;
+        }
+    }
+    for (; i < n && k < max; i++) {
+        if (ufds[i].revents)
+            ready[k++] = i;
+    }
+    return k;
+}
+#endif /* POLLSCAN_X86 */
+
+/* The implementations by name, best first; unsupported ones have a NULL
+   function after pollscan_init(). */
+static struct {
+    const char *name;
+    pollscan_func func;
+} pollscan_impls[] = {
+#ifdef POLLSCAN_X86
+    {"avx2",    pollscan_avx2},
+    {"sse2",    pollscan_sse2},
+#endif
+    {"scalar",  pollscan_scalar},
+    {NULL,      NULL}
+};
+
+static pollscan_func pollscan = pollscan_scalar;
+static const char *pollscan_name = "scalar";
+
+/* Select the implementation called name, or the best one the CPU supports
+   if name is NULL.  Returns 0 on success, -1 if name isn't available. */
+static int
+pollscan_select(const char *name)
+{
+    int i;
+
+    for (i = 0; pollscan_impls[i].name != NULL; i++) {
+        if (pollscan_impls[i].func == NULL)
+            continue;
+        if (name == NULL || strcmp(name, pollscan_impls[i].name) == 0) {
+            pollscan = pollscan_impls[i].func;
+            pollscan_name = pollscan_impls[i].name;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void
+pollscan_init(void)
+{
+#ifdef POLLSCAN_X86
+    int i;
+
+    __builtin_cpu_init();
+    for (i = 0; pollscan_impls[i].name != NULL; i++) {
+        if ((strcmp(pollscan_impls[i].name, "avx2") == 0 &&
+             !__builtin_cpu_supports("avx2")) ||
+            (strcmp(pollscan_impls[i].name, "sse2") == 0 &&
+             !__builtin_cpu_supports("sse2")))
+            pollscan_impls[i].func = NULL;
+    }
+#endif
+    pollscan_select(NULL);
+}
+
+#endif /* _POLLSCAN__H__ */
@@ -33,6 +33,10 @@
 #include <sys/poll.h>
 #endif
 
+#if defined(HAVE_POLL) && !defined(HAVE_BROKEN_POLL)
+#include "pollscan.h"
+#endif
+
 #ifdef __sgi
 /* This is missing from unistd.h */
 extern void bzero(void *, int);
@@ -42,6 +46,25 @@ extern void bzero(void *, int);
 #include <sys/types.h>
 #endif
 
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#endif
+
 #if defined(PYOS_OS2) && !defined(PYCC_GCC)
 #include <sys/time.h>
 #include <utils.h>
@@ -60,81 +83,434 @@ extern void bzero(void *, int);
 
 static PyObject *SelectError;
 
-/* list of Python objects and their file descriptor */
+/* The sets handed to select(2) are sized from the highest descriptor in
+   the call instead of FD_SETSIZE.  The kernel only reads the first
+   SELECT_NWORDS(nfds) words of each set, so a heap allocated array of
+   unsigned longs can stand in for an fd_set of any size.  The FD_* macros
+   can't be used on them: they are bounded by FD_SETSIZE.
+*/
+#define SELECT_NBITS            (8 * (Py_ssize_t)sizeof(unsigned long))
+#define SELECT_NWORDS(nfds)     (((nfds) + SELECT_NBITS - 1) / SELECT_NBITS)
+#define SELECT_SET(fd, set) \
+    ((set)[(fd) / SELECT_NBITS] |= 1UL << ((fd) % SELECT_NBITS))
+#define SELECT_CLR(fd, set) \
+    ((set)[(fd) / SELECT_NBITS] &= ~(1UL << ((fd) % SELECT_NBITS)))
+#define SELECT_ISSET(fd, set) \
+    (((set)[(fd) / SELECT_NBITS] >> ((fd) % SELECT_NBITS)) & 1UL)
+
+/* index of the lowest set bit of a non-zero word */
+#if defined(__GNUC__)
+#define SELECT_CTZ(word)        __builtin_ctzl(word)
+#else
+static int
+SELECT_CTZ(unsigned long word)
+{
+    int bit = 0;
+    while (!(word & 1UL)) {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+}
+#endif
+
+/* Convert a timeout in seconds to a timespec with nanosecond resolution.
+   Fractions of a nanosecond are rounded up, so a tiny positive timeout
+   never becomes a poll; a negative timeout gives a negative tv_sec.
+   returns -1 and sets the Python exception if an error occurred */
+static int
+select_timespec_d(double timeout, struct timespec *ts)
+{
+    double seconds;
+
+    if (timeout > (double)LONG_MAX) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "timeout period too long");
+        return -1;
+    }
+    seconds = floor(timeout);
+    ts->tv_sec = (time_t)seconds;
+    ts->tv_nsec = (long)ceil((timeout - seconds) * 1E9);
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+    return 0;
+}
+
+/* Same for a timeout object in seconds times scale. */
+static int
+select_timespec(PyObject *tout, double scale, struct timespec *ts)
+{
+    double timeout;
+
+    timeout = PyFloat_AsDouble(tout);
+    if (timeout == -1 && PyErr_Occurred())
+        return -1;
+    return select_timespec_d(timeout * scale, ts);
+}
+
+/* The timeout ts in milliseconds, rounded up, for the calls that take
+   nothing finer; -1 (forever) if ts is NULL. */
+static int
+select_timespec_ms(const struct timespec *ts)
+{
+    double ms;
+
+    if (ts == NULL)
+        return -1;
+    ms = ts->tv_sec * 1E3 + ceil(ts->tv_nsec / 1E6);
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/* Waits with a timeout up to this many nanoseconds keep the GIL: a call
+   that returns at once isn't worth handing the GIL over and queueing up
+   to get it back, which convoys the threads of a busy process.  0 keeps
+   it for zero timeouts only, -1 never.  See set_gil_threshold(). */
+static long select_gil_threshold = 0;
+
+static int
+select_keep_gil(const struct timespec *ts)
+{
+    return ts != NULL && ts->tv_sec == 0 &&
+        ts->tv_nsec <= select_gil_threshold;
+}
+
+/* Py_BEGIN_ALLOW_THREADS and Py_END_ALLOW_THREADS around a wait, unless
+   keep is true */
+#define SELECT_BEGIN_WAIT(keep) { \
+        PyThreadState *_save = (keep) ? NULL : PyEval_SaveThread();
+#define SELECT_END_WAIT \
+        if (_save != NULL) PyEval_RestoreThread(_save); }
+
+PyDoc_STRVAR(set_gil_threshold_doc,
+"set_gil_threshold(seconds) -> float\n\
+\n\
+select(), pselect(), poll() and the epoll poll methods keep the GIL for\n\
+a timeout up to seconds, below a millisecond, instead of letting other\n\
+threads run while they wait. The default, 0, keeps it for zero timeouts\n\
+only, which can't block; a negative value always releases it. Returns\n\
+the previous value.");
+
+static PyObject *
+select_set_gil_threshold(PyObject *self, PyObject *args)
+{
+    double seconds;
+    long old = select_gil_threshold;
+
+    if (!PyArg_ParseTuple(args, "d:set_gil_threshold", &seconds))
+        return NULL;
+    if (seconds >= 1E-3) {
+        PyErr_SetString(PyExc_ValueError,
+                        "threshold must be below a millisecond");
+        return NULL;
+    }
+    select_gil_threshold = seconds < 0 ? -1 : (long)(seconds * 1E9);
+    return PyFloat_FromDouble(old < 0 ? -1. : old * 1E-9);
+}
+
+#ifdef HAVE_EPOLL
+#if defined(SYS_epoll_pwait2) && defined(__LP64__)
+/* epoll_pwait2() came with Linux 5.11; cleared if the kernel lacks it */
+static int select_have_epoll_pwait2 = 1;
+#endif
+
+/* epoll_wait() with a timeout to the nanosecond; ts NULL waits forever.
+   sigmask, if not NULL, is installed for the duration of the wait as by
+   epoll_pwait().  Uses epoll_pwait2() where the kernel has it; otherwise
+   a timeout with a fraction of a millisecond is waited out in ppoll() on
+   the epoll fd and the events are then collected without blocking.
+   Call without the GIL. */
+static int
+select_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                  const struct timespec *ts, const sigset_t *sigmask)
+{
+    int n;
+#ifdef HAVE_PPOLL
+    struct pollfd ufd;
+#endif
+
+#if defined(SYS_epoll_pwait2) && defined(__LP64__)
+    if (select_have_epoll_pwait2) {
+        n = syscall(SYS_epoll_pwait2, epfd, events, maxevents, ts, sigmask,
+                    (size_t)(_NSIG / 8));
+        if (n >= 0 || errno != ENOSYS)
+            return n;
+        select_have_epoll_pwait2 = 0;
+    }
+#endif
+#ifdef HAVE_PPOLL
+    if (ts != NULL && ts->tv_nsec % 1000000 != 0) {
+        ufd.fd = epfd;
+        ufd.events = POLLIN;
+        ufd.revents = 0;
+        n = ppoll(&ufd, 1, ts, sigmask);
+        if (n <= 0)
+            return n;
+        return epoll_wait(epfd, events, maxevents, 0);
+    }
+#endif
+    return epoll_pwait(epfd, events, maxevents, select_timespec_ms(ts),
+                       sigmask);
+}
+#endif /* HAVE_EPOLL */
+
+#if defined(HAVE_PSELECT) || defined(HAVE_PPOLL)
+/* Build the signal mask for pselect()/ppoll(): the mask of the calling
+   thread with the signals of the iterable unblocked.
+   returns -1 and sets the Python exception if an error occurred */
+static int
+select_sigmask(PyObject *signals, sigset_t *mask)
+{
+    PyObject *it, *o;
+    long signum;
+
+    if (pthread_sigmask(SIG_BLOCK, NULL, mask) != 0) {
+        PyErr_SetFromErrno(SelectError);
+        return -1;
+    }
+    it = PyObject_GetIter(signals);
+    if (it == NULL)
+        return -1;
+    while ((o = PyIter_Next(it)) != NULL) {
+        signum = PyInt_AsLong(o);
+        Py_DECREF(o);
+        if (signum == -1 && PyErr_Occurred())
+            break;
+        if (signum < 1 || signum >= NSIG) {
+            PyErr_Format(PyExc_ValueError,
+                         "signal number %ld out of range", signum);
+            break;
+        }
+        sigdelset(mask, (int)signum);
+    }
+    Py_DECREF(it);
+    return PyErr_Occurred() ? -1 : 0;
+}
+#endif /* HAVE_PSELECT || HAVE_PPOLL */
+
+/* Python objects and their file descriptors.  The slots are kept dense;
+   index maps a descriptor to its first slot, so the objects of the ready
+   descriptors are found without looking at the others.  A descriptor
+   that occurs more than once is chained through next.
+*/
 typedef struct {
     PyObject *obj;                           /* owned reference */
     SOCKET fd;
-    int sentinel;                            /* -1 == sentinel */
-} pylist;
+    int next;                                /* same fd, -1 == end */
+} fdslot;
+
+typedef struct {
+    fdslot *slots;
+    Py_ssize_t len;                          /* slots in use */
+    Py_ssize_t alloc;                        /* slots allocated */
+    int *index;                              /* fd -> slot, -1 if unused */
+    Py_ssize_t nindex;                       /* entries allocated in index */
+} fdtable;
+
+/* Make the index cover the first nfds descriptors. */
+static int
+fdtable_reserve(fdtable *t, Py_ssize_t nfds)
+{
+    Py_ssize_t i;
+    int *index;
+
+    if (nfds <= t->nindex)
+        return 0;
+    if (nfds < 2 * t->nindex)
+        nfds = 2 * t->nindex;
+    index = t->index;
+    PyMem_Resize(index, int, nfds);
+    if (index == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = t->nindex; i < nfds; i++)
+        index[i] = -1;
+    t->index = index;
+    t->nindex = nfds;
+    return 0;
+}
+
+/* Append o with descriptor fd, which the index must cover.  Steals the
+   reference to o, even on failure. */
+static int
+fdtable_append(fdtable *t, PyObject *o, SOCKET fd)
+{
+    if (t->len == t->alloc) {
+        Py_ssize_t alloc = t->alloc ? 2 * t->alloc : 8;
+        fdslot *slots = t->slots;
+        PyMem_Resize(slots, fdslot, alloc);
+        if (slots == NULL) {
+            Py_DECREF(o);
+            PyErr_NoMemory();
+            return -1;
+        }
+        t->slots = slots;
+        t->alloc = alloc;
+    }
+    t->slots[t->len].obj = o;
+    t->slots[t->len].fd = fd;
+    t->slots[t->len].next = t->index[fd];
+    t->index[fd] = (int)t->len++;
+    return 0;
+}
+
+/* Drop all objects; only the index entries in use are reset. */
+static void
+fdtable_reap(fdtable *t)
+{
+    PyObject *o;
+
+    while (t->len > 0) {
+        t->len--;
+        t->index[t->slots[t->len].fd] = -1;
+        o = t->slots[t->len].obj;
+        Py_DECREF(o);
+    }
+}
+
+static void
+fdtable_free(fdtable *t)
+{
+    fdtable_reap(t);
+    PyMem_Free(t->slots);
+    PyMem_Free(t->index);
+}
+
+/* Scratch space of select_select().  One instance is cached between calls;
+   a call that finds the cache taken by another thread (the GIL is released
+   around select(2)) allocates a private one instead.
+*/
+typedef struct {
+    unsigned long *bits;                     /* read, write and except sets */
+    Py_ssize_t nwords;                       /* words allocated per set */
+    fdtable tables[3];
+} select_buffers;
+
+static select_buffers *select_cache = NULL;
+
+static select_buffers *
+select_buffers_get(void)
+{
+    select_buffers *buf = select_cache;
+
+    if (buf != NULL) {
+        select_cache = NULL;
+        return buf;
+    }
+    buf = PyMem_New(select_buffers, 1);
+    if (buf == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(buf, 0, sizeof(select_buffers));
+    return buf;
+}
 
 static void
-reap_obj(pylist fd2obj[FD_SETSIZE + 1])
+select_buffers_put(select_buffers *buf)
 {
     int i;
-    for (i = 0; i < FD_SETSIZE + 1 && fd2obj[i].sentinel >= 0; i++) {
-        Py_XDECREF(fd2obj[i].obj);
-        fd2obj[i].obj = NULL;
+
+    for (i = 0; i < 3; i++)
+        fdtable_reap(&buf->tables[i]);
+    if (select_cache == NULL) {
+        select_cache = buf;
+        return;
+    }
+    PyMem_Free(buf->bits);
+    for (i = 0; i < 3; i++)
+        fdtable_free(&buf->tables[i]);
+    PyMem_Free(buf);
+}
+
+/* Make room for nfds descriptors in each of the three sets and clear them.
+   Returns 0 on success, -1 with MemoryError set otherwise. */
+static int
+select_buffers_bits(select_buffers *buf, int nfds)
+{
+    Py_ssize_t nwords = SELECT_NWORDS(nfds);
+
+    if (nwords > buf->nwords) {
+        unsigned long *bits = buf->bits;
+        PyMem_Resize(bits, unsigned long, 3 * nwords);
+        if (bits == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        buf->bits = bits;
+        buf->nwords = nwords;
     }
-    fd2obj[0].sentinel = -1;
+    if (nwords)
+        memset(buf->bits, 0, 3 * buf->nwords * sizeof(unsigned long));
+    return 0;
 }
 
+/* Descriptors past FD_SETSIZE are fine as long as they can actually be
+   open; anything larger is most likely garbage and would make us allocate
+   a huge bitmap. */
+static int
+select_fd_in_range(SOCKET v)
+{
+#ifdef RLIMIT_NOFILE
+    struct rlimit rl;
+
+    if (v < FD_SETSIZE)
+        return 1;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_max == RLIM_INFINITY)
+        return 1;
+    return (rlim_t)v < rl.rlim_max;
+#else
+    return v < FD_SETSIZE;
+#endif
+}
 
-/* returns -1 and sets the Python exception if an error occurred, otherwise
-   returns a number >= 0
+/* Fill t with the objects of seq and their file descriptors.
+   returns -1 and sets the Python exception if an error occurred, otherwise
+   returns the highest file descriptor plus one (0 for an empty sequence)
 */
 static int
-seq2set(PyObject *seq, fd_set *set, pylist fd2obj[FD_SETSIZE + 1])
+seq2set(PyObject *seq, fdtable *t)
 {
     int i;
     int max = -1;
-    int index = 0;
     int len = -1;
     PyObject* fast_seq = NULL;
     PyObject* o = NULL;
 
-    fd2obj[0].obj = (PyObject*)0;            /* set list to zero size */
-    FD_ZERO(set);
-
     fast_seq = PySequence_Fast(seq, "arguments 1-3 must be sequences");
     if (!fast_seq)
         return -1;
 
     len = PySequence_Fast_GET_SIZE(fast_seq);
 
-    for (i = 0; i < len; i++)  {
+    for (i = 0; i < len && i < PySequence_Fast_GET_SIZE(fast_seq); i++)  {
         SOCKET v;
 
         /* any intervening fileno() calls could decr this refcnt */
         if (!(o = PySequence_Fast_GET_ITEM(fast_seq, i)))
-            return -1;
+            goto finally;
 
         Py_INCREF(o);
         v = PyObject_AsFileDescriptor( o );
         if (v == -1) goto finally;
 
-#if defined(_MSC_VER)
-        max = 0;                             /* not used for Win32 */
-#else  /* !_MSC_VER */
-        if (v < 0 || v >= FD_SETSIZE) {
+        if (v < 0 || !select_fd_in_range(v)) {
             PyErr_SetString(PyExc_ValueError,
                         "filedescriptor out of range in select()");
             goto finally;
         }
         if (v > max)
             max = v;
-#endif /* _MSC_VER */
-        FD_SET(v, set);
 
-        /* add object and its file descriptor to the list */
-        if (index >= FD_SETSIZE) {
-            PyErr_SetString(PyExc_ValueError,
-                          "too many file descriptors in select()");
+        /* add object and its file descriptor to the table */
+        if (fdtable_reserve(t, (Py_ssize_t)v + 1) < 0)
             goto finally;
+        if (fdtable_append(t, o, v) < 0) {
+            Py_DECREF(fast_seq);
+            return -1;
         }
-        fd2obj[index].obj = o;
-        fd2obj[index].fd = v;
-        fd2obj[index].sentinel = 0;
-        fd2obj[++index].sentinel = -1;
     }
     Py_DECREF(fast_seq);
     return max+1;
@@ -145,903 +521,3909 @@ seq2set(PyObject *seq, fd_set *set, pylist fd2obj[FD_SETSIZE + 1])
     return -1;
 }
 
-/* returns NULL and sets the Python exception if an error occurred */
-static PyObject *
-set2list(fd_set *set, pylist fd2obj[FD_SETSIZE + 1])
+/* Set the bits of all descriptors in t */
+static void
+table2set(fdtable *t, unsigned long *set)
 {
-    int i, j, count=0;
-    PyObject *list, *o;
-    SOCKET fd;
+    Py_ssize_t j;
 
-    for (j = 0; fd2obj[j].sentinel >= 0; j++) {
-        if (FD_ISSET(fd2obj[j].fd, set))
-            count++;
-    }
-    list = PyList_New(count);
-    if (!list)
-        return NULL;
+    for (j = 0; j < t->len; j++)
+        SELECT_SET(t->slots[j].fd, set);
+}
 
-    i = 0;
-    for (j = 0; fd2obj[j].sentinel >= 0; j++) {
-        fd = fd2obj[j].fd;
-        if (FD_ISSET(fd, set)) {
-#ifndef _MSC_VER
-            if (fd > FD_SETSIZE) {
-                PyErr_SetString(PyExc_SystemError,
-               "filedescriptor out of range returned in select()");
-                goto finally;
-            }
-#endif
-            o = fd2obj[j].obj;
-            fd2obj[j].obj = NULL;
-            /* transfer ownership */
-            if (PyList_SetItem(list, i, o) < 0)
-                goto finally;
+static int
+fdtable_slot_cmp(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
 
-            i++;
-        }
-    }
-    return list;
-  finally:
-    Py_DECREF(list);
-    return NULL;
+    return x < y ? -1 : x > y;
 }
 
-#undef SELECT_USES_HEAP
-#if FD_SETSIZE > 1024
-#define SELECT_USES_HEAP
-#endif /* FD_SETSIZE > 1024 */
-
+/* Build the list of objects in t whose descriptor is set in set, in the
+   order they were added, duplicates included, as select() always has.
+   The set is scanned a word at a time and the slots of a ready
+   descriptor are found through the index, so the cost depends on the
+   number of ready descriptors, not on the size of t; the slot numbers,
+   which are the argument positions, are sorted back into order.
+   returns NULL and sets the Python exception if an error occurred */
 static PyObject *
-select_select(PyObject *self, PyObject *args)
+set2list(unsigned long *set, int nfds, fdtable *t)
 {
-#ifdef SELECT_USES_HEAP
-    pylist *rfd2obj, *wfd2obj, *efd2obj;
-#else  /* !SELECT_USES_HEAP */
-    /* XXX: All this should probably be implemented as follows:
-     * - find the highest descriptor we're interested in
-     * - add one
-     * - that's the size
-     * See: Stevens, APitUE, $12.5.1
-     */
-    pylist rfd2obj[FD_SETSIZE + 1];
-    pylist wfd2obj[FD_SETSIZE + 1];
-    pylist efd2obj[FD_SETSIZE + 1];
-#endif /* SELECT_USES_HEAP */
-    PyObject *ifdlist, *ofdlist, *efdlist;
-    PyObject *ret = NULL;
-    PyObject *tout = Py_None;
-    fd_set ifdset, ofdset, efdset;
-    double timeout;
-    struct timeval tv, *tvp;
-    long seconds;
-    int imax, omax, emax, max;
-    int n;
-
-    /* convert arguments */
-    if (!PyArg_UnpackTuple(args, "select", 3, 4,
-                          &ifdlist, &ofdlist, &efdlist, &tout))
-        return NULL;
-
-    if (tout == Py_None)
-        tvp = (struct timeval *)0;
-    else if (!PyNumber_Check(tout)) {
-        PyErr_SetString(PyExc_TypeError,
-                        "timeout must be a float or None");
-        return NULL;
-    }
-    else {
-        timeout = PyFloat_AsDouble(tout);
-        if (timeout == -1 && PyErr_Occurred())
-            return NULL;
-        if (timeout > (double)LONG_MAX) {
-            PyErr_SetString(PyExc_OverflowError,
-                            "timeout period too long");
-            return NULL;
+    Py_ssize_t w, nwords, i, count = 0;
+    unsigned long word;
+    PyObject *list, *o;
+    int fd, j, *ready;
+
+    nwords = SELECT_NWORDS(nfds);
+    if (nwords > SELECT_NWORDS(t->nindex))
+        nwords = SELECT_NWORDS(t->nindex);
+
+    for (w = 0; w < nwords; w++) {
+        for (word = set[w]; word; word &= word - 1) {
+            fd = (int)(w * SELECT_NBITS) + SELECT_CTZ(word);
+            if (fd >= t->nindex)
+                break;
+            for (j = t->index[fd]; j >= 0; j = t->slots[j].next)
+                count++;
         }
-        seconds = (long)timeout;
-        timeout = timeout - (double)seconds;
-        tv.tv_sec = seconds;
-        tv.tv_usec = (long)(timeout * 1E6);
-        tvp = &tv;
     }
-
-
-#ifdef SELECT_USES_HEAP
-    /* Allocate memory for the lists */
-    rfd2obj = PyMem_NEW(pylist, FD_SETSIZE + 1);
-    wfd2obj = PyMem_NEW(pylist, FD_SETSIZE + 1);
-    efd2obj = PyMem_NEW(pylist, FD_SETSIZE + 1);
-    if (rfd2obj == NULL || wfd2obj == NULL || efd2obj == NULL) {
-        if (rfd2obj) PyMem_DEL(rfd2obj);
-        if (wfd2obj) PyMem_DEL(wfd2obj);
-        if (efd2obj) PyMem_DEL(efd2obj);
+    list = PyList_New(count);
+    if (!list || count == 0)
+        return list;
+    ready = PyMem_New(int, count);
+    if (ready == NULL) {
+        Py_DECREF(list);
         return PyErr_NoMemory();
     }
-#endif /* SELECT_USES_HEAP */
-    /* Convert sequences to fd_sets, and get maximum fd number
-     * propagates the Python exception set in seq2set()
-     */
-    rfd2obj[0].sentinel = -1;
-    wfd2obj[0].sentinel = -1;
-    efd2obj[0].sentinel = -1;
-    if ((imax=seq2set(ifdlist, &ifdset, rfd2obj)) < 0)
-        goto finally;
-    if ((omax=seq2set(ofdlist, &ofdset, wfd2obj)) < 0)
-        goto finally;
-    if ((emax=seq2set(efdlist, &efdset, efd2obj)) < 0)
-        goto finally;
-    max = imax;
-    if (omax > max) max = omax;
-    if (emax > max) max = emax;
-
-    Py_BEGIN_ALLOW_THREADS
-    n = select(max, &ifdset, &ofdset, &efdset, tvp);
-    Py_END_ALLOW_THREADS
 
-#ifdef MS_WINDOWS
-    if (n == SOCKET_ERROR) {
-        PyErr_SetExcFromWindowsErr(SelectError, WSAGetLastError());
-    }
-#else
-    if (n < 0) {
-        PyErr_SetFromErrno(SelectError);
+    i = 0;
+    for (w = 0; w < nwords && i < count; w++) {
+        for (word = set[w]; word; word &= word - 1) {
+            fd = (int)(w * SELECT_NBITS) + SELECT_CTZ(word);
+            if (fd >= t->nindex)
+                break;
+            for (j = t->index[fd]; j >= 0 && i < count;
+                 j = t->slots[j].next)
+                ready[i++] = j;
+        }
     }
-#endif
-    else {
-        /* any of these three calls can raise an exception.  it's more
-           convenient to test for this after all three calls... but
-           is that acceptable?
-        */
-        ifdlist = set2list(&ifdset, rfd2obj);
-        ofdlist = set2list(&ofdset, wfd2obj);
-        efdlist = set2list(&efdset, efd2obj);
-        if (PyErr_Occurred())
-            ret = NULL;
-        else
-            ret = PyTuple_Pack(3, ifdlist, ofdlist, efdlist);
-
-        Py_DECREF(ifdlist);
-        Py_DECREF(ofdlist);
-        Py_DECREF(efdlist);
+    qsort(ready, count, sizeof(int), fdtable_slot_cmp);
+    for (i = 0; i < count; i++) {
+        o = t->slots[ready[i]].obj;
+        Py_INCREF(o);
+        PyList_SET_ITEM(list, i, o);
     }
-
-  finally:
-    reap_obj(rfd2obj);
-    reap_obj(wfd2obj);
-    reap_obj(efd2obj);
-#ifdef SELECT_USES_HEAP
-    PyMem_DEL(rfd2obj);
-    PyMem_DEL(wfd2obj);
-    PyMem_DEL(efd2obj);
-#endif /* SELECT_USES_HEAP */
-    return ret;
+    PyMem_Free(ready);
+    return list;
 }
 
-#if defined(HAVE_POLL) && !defined(HAVE_BROKEN_POLL)
-/*
- * poll() support
+/* **************************************************************************
+ *                      FdSet: a persistent set of descriptors for select()
+ *
+ * The objects are resolved to file descriptors once, when they are added.
+ * select() copies the bitmap and maps the ready descriptors back to their
+ * objects, so an unchanged set costs neither fileno() calls nor
+ * allocations on the next call.
  */
 
 typedef struct {
     PyObject_HEAD
-    PyObject *dict;
-    int ufd_uptodate;
-    int ufd_len;
-    struct pollfd *ufds;
-} pollObject;
+    unsigned long *bits;                     /* bitmap of the descriptors */
+    Py_ssize_t nwords;                       /* words allocated in bits */
+    fdtable table;                           /* members, one per fd */
+    int nfds;                                /* highest descriptor + 1 */
+} fdset_Object;
 
-static PyTypeObject poll_Type;
+static PyTypeObject fdset_Type;
 
-/* Update the malloc'ed array of pollfds to match the dictionary
-   contained within a pollObject.  Return 1 on success, 0 on an error.
-*/
+#define fdset_Check(op) (PyObject_TypeCheck((op), &fdset_Type))
 
-static int
-update_ufd_array(pollObject *self)
+/* Returns the descriptor of o, or -1 with an exception set. */
+static SOCKET
+fdset_fileno(PyObject *o)
 {
-    Py_ssize_t i, pos;
-    PyObject *key, *value;
-    struct pollfd *old_ufds = self->ufds;
+    SOCKET fd = PyObject_AsFileDescriptor(o);
 
-    self->ufd_len = PyDict_Size(self->dict);
-    PyMem_RESIZE(self->ufds, struct pollfd, self->ufd_len);
-    if (self->ufds == NULL) {
-        self->ufds = old_ufds;
-        PyErr_NoMemory();
-        return 0;
+    if (fd == -1)
+        return -1;
+    if (!select_fd_in_range(fd)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "filedescriptor out of range in select()");
+        return -1;
     }
+    return fd;
+}
 
-    i = pos = 0;
-    while (PyDict_Next(self->dict, &pos, &key, &value)) {
-        self->ufds[i].fd = PyInt_AsLong(key);
-        self->ufds[i].events = (short)PyInt_AsLong(value);
-        i++;
+/* Make the bitmap and the index cover fd. */
+static int
+fdset_reserve(fdset_Object *self, SOCKET fd)
+{
+    Py_ssize_t nwords = SELECT_NWORDS((Py_ssize_t)fd + 1);
+    unsigned long *bits;
+
+    if (nwords <= self->nwords)
+        return 0;
+    if (nwords < 2 * self->nwords)
+        nwords = 2 * self->nwords;
+
+    if (fdtable_reserve(&self->table, nwords * SELECT_NBITS) < 0)
+        return -1;
+    bits = self->bits;
+    PyMem_Resize(bits, unsigned long, nwords);
+    if (bits == NULL) {
+        PyErr_NoMemory();
+        return -1;
     }
-    self->ufd_uptodate = 1;
-    return 1;
+    memset(bits + self->nwords, 0,
+           (nwords - self->nwords) * sizeof(unsigned long));
+    self->bits = bits;
+    self->nwords = nwords;
+    return 0;
 }
 
-PyDoc_STRVAR(poll_register_doc,
-"register(fd [, eventmask] ) -> None\n\n\
-Register a file descriptor with the polling object.\n\
-fd -- either an integer, or an object with a fileno() method returning an\n\
-      int.\n\
-events -- an optional bitmask describing the type of events to check for");
-
-static PyObject *
-poll_register(pollObject *self, PyObject *args)
+static int
+fdset_internal_add(fdset_Object *self, PyObject *o)
 {
-    PyObject *o, *key, *value;
-    int fd, events = POLLIN | POLLPRI | POLLOUT;
-    int err;
+    fdtable *t = &self->table;
+    SOCKET fd;
+    PyObject *old;
 
-    if (!PyArg_ParseTuple(args, "O|i:register", &o, &events)) {
-        return NULL;
+    fd = fdset_fileno(o);
+    if (fd == -1)
+        return -1;
+    if (fdset_reserve(self, fd) < 0)
+        return -1;
+
+    Py_INCREF(o);
+    if (t->index[fd] >= 0) {
+        /* same descriptor, possibly a different object: replace it */
+        old = t->slots[t->index[fd]].obj;
+        t->slots[t->index[fd]].obj = o;
+        Py_DECREF(old);
+        return 0;
     }
+    if (fdtable_append(t, o, fd) < 0)
+        return -1;
+    SELECT_SET(fd, self->bits);
+    if (fd >= self->nfds)
+        self->nfds = fd + 1;
+    return 0;
+}
 
-    fd = PyObject_AsFileDescriptor(o);
-    if (fd == -1) return NULL;
+static void
+fdset_internal_discard(fdset_Object *self, SOCKET fd)
+{
+    fdtable *t = &self->table;
+    Py_ssize_t pos, last, w;
+    PyObject *old;
+    unsigned long word;
+    int bit;
 
-    /* Add entry to the internal dictionary: the key is the
-       file descriptor, and the value is the event mask. */
-    key = PyInt_FromLong(fd);
-    if (key == NULL)
-        return NULL;
-    value = PyInt_FromLong(events);
-    if (value == NULL) {
-        Py_DECREF(key);
-        return NULL;
+    if (fd >= self->nfds || t->index[fd] < 0)
+        return;
+
+    /* swap the last slot into the hole */
+    pos = t->index[fd];
+    old = t->slots[pos].obj;
+    last = --t->len;
+    if (pos != last) {
+        t->slots[pos] = t->slots[last];
+        t->index[t->slots[pos].fd] = (int)pos;
+    }
+    t->index[fd] = -1;
+    SELECT_CLR(fd, self->bits);
+
+    if (fd + 1 == self->nfds) {
+        /* find the new highest descriptor */
+        w = SELECT_NWORDS(self->nfds);
+        while (w > 0 && self->bits[w - 1] == 0)
+            w--;
+        if (w == 0) {
+            self->nfds = 0;
+        }
+        else {
+            word = self->bits[w - 1];
+            for (bit = SELECT_NBITS - 1; !((word >> bit) & 1UL); bit--)
+                ;
+            self->nfds = (int)((w - 1) * SELECT_NBITS + bit + 1);
+        }
     }
-    err = PyDict_SetItem(self->dict, key, value);
-    Py_DECREF(key);
-    Py_DECREF(value);
-    if (err < 0)
+    Py_DECREF(old);
+}
+static PyObject *
+fdset_add(fdset_Object *self, PyObject *o)
+{
+    if (fdset_internal_add(self, o) < 0)
         return NULL;
-
-    self->ufd_uptodate = 0;
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(poll_modify_doc,
-"modify(fd, eventmask) -> None\n\n\
-Modify an already registered file descriptor.\n\
-fd -- either an integer, or an object with a fileno() method returning an\n\
-      int.\n\
-events -- an optional bitmask describing the type of events to check for");
+PyDoc_STRVAR(fdset_add_doc,
+"add(fd) -> None\n\
+\n\
+Add fd to the set. fd is either an integer or an object with a fileno()\n\
+method returning an int. An object with the same descriptor as a member\n\
+replaces that member.");
 
 static PyObject *
-poll_modify(pollObject *self, PyObject *args)
+fdset_discard(fdset_Object *self, PyObject *o)
 {
-    PyObject *o, *key, *value;
-    int fd, events;
-    int err;
+    SOCKET fd = PyObject_AsFileDescriptor(o);
 
-    if (!PyArg_ParseTuple(args, "Oi:modify", &o, &events)) {
+    if (fd == -1)
         return NULL;
-    }
+    fdset_internal_discard(self, fd);
+    Py_RETURN_NONE;
+}
 
-    fd = PyObject_AsFileDescriptor(o);
-    if (fd == -1) return NULL;
+PyDoc_STRVAR(fdset_discard_doc,
+"discard(fd) -> None\n\
+\n\
+Remove the member with the descriptor of fd, if there is one.");
 
-    /* Modify registered fd */
-    key = PyInt_FromLong(fd);
-    if (key == NULL)
-        return NULL;
-    if (PyDict_GetItem(self->dict, key) == NULL) {
-        errno = ENOENT;
-        PyErr_SetFromErrno(PyExc_IOError);
-        return NULL;
-    }
-    value = PyInt_FromLong(events);
-    if (value == NULL) {
-        Py_DECREF(key);
-        return NULL;
-    }
-    err = PyDict_SetItem(self->dict, key, value);
-    Py_DECREF(key);
-    Py_DECREF(value);
-    if (err < 0)
-        return NULL;
+static int
+fdset_tp_clear(fdset_Object *self)
+{
+    while (self->table.len > 0)
+        fdset_internal_discard(self,
+                               self->table.slots[self->table.len - 1].fd);
+    return 0;
+}
+
+static PyObject *
+fdset_clear(fdset_Object *self)
+{
+    fdset_tp_clear(self);
+    Py_RETURN_NONE;
+}
 
-    self->ufd_uptodate = 0;
+PyDoc_STRVAR(fdset_clear_doc,
+"clear() -> None\n\
+\n\
+Remove all members.");
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static int
+fdset_traverse(fdset_Object *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->table.len; i++)
+        Py_VISIT(self->table.slots[i].obj);
+    return 0;
 }
 
+static Py_ssize_t
+fdset_length(fdset_Object *self)
+{
+    return self->table.len;
+}
 
-PyDoc_STRVAR(poll_unregister_doc,
-"unregister(fd) -> None\n\n\
-Remove a file descriptor being tracked by the polling object.");
+static int
+fdset_contains(fdset_Object *self, PyObject *o)
+{
+    SOCKET fd = PyObject_AsFileDescriptor(o);
+
+    if (fd == -1)
+        return -1;
+    return fd < self->nfds && self->table.index[fd] >= 0;
+}
 
 static PyObject *
-poll_unregister(pollObject *self, PyObject *o)
+fdset_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    PyObject *key;
-    int fd;
+    fdset_Object *self;
+    PyObject *iterable = NULL, *it, *o;
+    static char *kwlist[] = {"iterable", NULL};
 
-    fd = PyObject_AsFileDescriptor( o );
-    if (fd == -1)
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:FdSet", kwlist,
+                                     &iterable))
         return NULL;
 
-    /* Check whether the fd is already in the array */
-    key = PyInt_FromLong(fd);
-    if (key == NULL)
+    assert(type != NULL && type->tp_alloc != NULL);
+    self = (fdset_Object *) type->tp_alloc(type, 0);
+    if (self == NULL)
         return NULL;
 
-    if (PyDict_DelItem(self->dict, key) == -1) {
-        Py_DECREF(key);
-        /* This will simply raise the KeyError set by PyDict_DelItem
-           if the file descriptor isn't registered. */
-        return NULL;
+    if (iterable != NULL) {
+        it = PyObject_GetIter(iterable);
+        if (it == NULL) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        while ((o = PyIter_Next(it)) != NULL) {
+            if (fdset_internal_add(self, o) < 0) {
+                Py_DECREF(o);
+                break;
+            }
+            Py_DECREF(o);
+        }
+        Py_DECREF(it);
+        if (PyErr_Occurred()) {
+            Py_DECREF(self);
+            return NULL;
+        }
     }
+    return (PyObject *)self;
+}
 
-    Py_DECREF(key);
-    self->ufd_uptodate = 0;
-
-    Py_INCREF(Py_None);
-    return Py_None;
+static void
+fdset_dealloc(fdset_Object *self)
+{
+    PyObject_GC_UnTrack(self);
+    fdset_tp_clear(self);
+    PyMem_Free(self->bits);
+    fdtable_free(&self->table);
+    Py_TYPE(self)->tp_free(self);
 }
 
-PyDoc_STRVAR(poll_poll_doc,
-"poll( [timeout] ) -> list of (fd, event) 2-tuples\n\n\
-Polls the set of registered file descriptors, returning a list containing \n\
-any descriptors that have events or errors to report.");
+static PyMethodDef fdset_methods[] = {
+    {"add",             (PyCFunction)fdset_add,         METH_O,
+     fdset_add_doc},
+    {"discard",         (PyCFunction)fdset_discard,     METH_O,
+     fdset_discard_doc},
+    {"clear",           (PyCFunction)fdset_clear,       METH_NOARGS,
+     fdset_clear_doc},
+    {NULL,      NULL},
+};
+
+static PySequenceMethods fdset_as_sequence = {
+    (lenfunc)fdset_length,                              /* sq_length */
+    0,                                                  /* sq_concat */
+    0,                                                  /* sq_repeat */
+    0,                                                  /* sq_item */
+    0,                                                  /* sq_slice */
+    0,                                                  /* sq_ass_item */
+    0,                                                  /* sq_ass_slice */
+    (objobjproc)fdset_contains,                         /* sq_contains */
+};
+
+PyDoc_STRVAR(fdset_doc,
+"select_backport.FdSet([iterable])\n\
+\n\
+A set of file descriptors that can be passed to select() in place of any\n\
+of the three sequences. The descriptors are looked up once, when they\n\
+are added, and select() returns the member objects that are ready.");
+
+static PyTypeObject fdset_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "select_backport.FdSet",                            /* tp_name */
+    sizeof(fdset_Object),                               /* tp_basicsize */
+    0,                                                  /* tp_itemsize */
+    (destructor)fdset_dealloc,                          /* tp_dealloc */
+    0,                                                  /* tp_print */
+    0,                                                  /* tp_getattr */
+    0,                                                  /* tp_setattr */
+    0,                                                  /* tp_compare */
+    0,                                                  /* tp_repr */
+    0,                                                  /* tp_as_number */
+    &fdset_as_sequence,                                 /* tp_as_sequence */
+    0,                                                  /* tp_as_mapping */
+    0,                                                  /* tp_hash */
+    0,                                                  /* tp_call */
+    0,                                                  /* tp_str */
+    PyObject_GenericGetAttr,                            /* tp_getattro */
+    0,                                                  /* tp_setattro */
+    0,                                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,            /* tp_flags */
+    fdset_doc,                                          /* tp_doc */
+    (traverseproc)fdset_traverse,                       /* tp_traverse */
+    (inquiry)fdset_tp_clear,                            /* tp_clear */
+    0,                                                  /* tp_richcompare */
+    0,                                                  /* tp_weaklistoffset */
+    0,                                                  /* tp_iter */
+    0,                                                  /* tp_iternext */
+    fdset_methods,                                      /* tp_methods */
+    0,                                                  /* tp_members */
+    0,                                                  /* tp_getset */
+    0,                                                  /* tp_base */
+    0,                                                  /* tp_dict */
+    0,                                                  /* tp_descr_get */
+    0,                                                  /* tp_descr_set */
+    0,                                                  /* tp_dictoffset */
+    0,                                                  /* tp_init */
+    0,                                                  /* tp_alloc */
+    fdset_new,                                          /* tp_new */
+    0,                                                  /* tp_free */
+};
+
+#define SELECT_BITS     1           /* return the bitmaps, not lists */
+#define SELECT_PSELECT  2           /* pselect(2): ns timeout and sigmask */
 
+/* Common part of select(), select_bits() and pselect() */
 static PyObject *
-poll_poll(pollObject *self, PyObject *args)
+select_internal(PyObject *args, const char *fname, int mode)
 {
-    PyObject *result_list = NULL, *tout = NULL;
-    int timeout = 0, poll_result, i, j;
-    PyObject *value = NULL, *num = NULL;
+    select_buffers *buf;
+    PyObject *fdlists[3], *result[3];
+    fdtable *tables[3];
+    PyObject *ret = NULL;
+    PyObject *tout = Py_None;
+    unsigned long *sets[3];
+    double timeout;
+    struct timeval tv, *tvp;
+    long seconds;
+    int nfds[3], max;
+    int i, n, keep;
+    PyObject *signals = Py_None;
+#ifdef HAVE_PSELECT
+    struct timespec ts, *tsp = NULL;
+    sigset_t sigmask, *sigmaskp = NULL;
+#endif
 
-    if (!PyArg_UnpackTuple(args, "poll", 0, 1, &tout)) {
+    /* convert arguments */
+    if (!PyArg_UnpackTuple(args, fname, 3, (mode & SELECT_PSELECT) ? 5 : 4,
+                          &fdlists[0], &fdlists[1], &fdlists[2], &tout,
+                          &signals))
         return NULL;
-    }
 
-    /* Check values for timeout */
-    if (tout == NULL || tout == Py_None)
-        timeout = -1;
+    if (tout == Py_None)
+        tvp = (struct timeval *)0;
     else if (!PyNumber_Check(tout)) {
         PyErr_SetString(PyExc_TypeError,
-                        "timeout must be an integer or None");
+                        "timeout must be a float or None");
         return NULL;
     }
-    else {
-        tout = PyNumber_Int(tout);
-        if (!tout)
+#ifdef HAVE_PSELECT
+    else if (mode & SELECT_PSELECT) {
+        if (select_timespec(tout, 1.0, &ts) < 0)
             return NULL;
-        timeout = PyInt_AsLong(tout);
-        Py_DECREF(tout);
+        tsp = &ts;
+        tvp = NULL;
+    }
+#endif
+    else {
+        timeout = PyFloat_AsDouble(tout);
         if (timeout == -1 && PyErr_Occurred())
             return NULL;
+        if (timeout > (double)LONG_MAX) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "timeout period too long");
+            return NULL;
+        }
+        seconds = (long)timeout;
+        timeout = timeout - (double)seconds;
+        tv.tv_sec = seconds;
+        tv.tv_usec = (long)(timeout * 1E6);
+        tvp = &tv;
     }
 
-    /* Ensure the ufd array is up to date */
-    if (!self->ufd_uptodate)
-        if (update_ufd_array(self) == 0)
+#ifdef HAVE_PSELECT
+    if (signals != Py_None) {
+        if (select_sigmask(signals, &sigmask) < 0)
             return NULL;
-
-    /* call poll() */
-    Py_BEGIN_ALLOW_THREADS
-    poll_result = poll(self->ufds, self->ufd_len, timeout);
-    Py_END_ALLOW_THREADS
-
-    if (poll_result < 0) {
-        PyErr_SetFromErrno(SelectError);
-        return NULL;
+        sigmaskp = &sigmask;
     }
+#endif
 
-    /* build the result list */
-
-    result_list = PyList_New(poll_result);
-    if (!result_list)
+    buf = select_buffers_get();
+    if (buf == NULL)
         return NULL;
-    else {
-        for (i = 0, j = 0; j < poll_result; j++) {
-            /* skip to the next fired descriptor */
-            while (!self->ufds[i].revents) {
-                i++;
-            }
-            /* if we hit a NULL return, set value to NULL
-               and break out of loop; code at end will
-               clean up result_list */
-            value = PyTuple_New(2);
-            if (value == NULL)
-                goto error;
-            num = PyInt_FromLong(self->ufds[i].fd);
-            if (num == NULL) {
-                Py_DECREF(value);
-                goto error;
-            }
-            PyTuple_SET_ITEM(value, 0, num);
 
-            /* The &0xffff is a workaround for AIX.  'revents'
-               is a 16-bit short, and IBM assigned POLLNVAL
-               to be 0x8000, so the conversion to int results
-               in a negative number. See SF bug #923315. */
-            num = PyInt_FromLong(self->ufds[i].revents & 0xffff);
-            if (num == NULL) {
-                Py_DECREF(value);
-                goto error;
-            }
-            PyTuple_SET_ITEM(value, 1, num);
-            if ((PyList_SetItem(result_list, j, value)) == -1) {
-                Py_DECREF(value);
-                goto error;
-            }
-            i++;
+    /* Convert sequences to fd tables, and get maximum fd number
+     * propagates the Python exception set in seq2set()
+     */
+    for (i = 0; i < 3; i++) {
+        if (fdset_Check(fdlists[i])) {
+            tables[i] = &((fdset_Object *)fdlists[i])->table;
+            nfds[i] = ((fdset_Object *)fdlists[i])->nfds;
+        }
+        else {
+            tables[i] = &buf->tables[i];
+            if ((nfds[i] = seq2set(fdlists[i], tables[i])) < 0)
+                goto finally;
         }
     }
-    return result_list;
+    max = nfds[0];
+    if (nfds[1] > max) max = nfds[1];
+    if (nfds[2] > max) max = nfds[2];
 
-  error:
-    Py_DECREF(result_list);
-    return NULL;
-}
+    /* size the bitmaps from the highest descriptor; FdSets only need
+       their bitmap copied */
+    if (select_buffers_bits(buf, max) < 0)
+        goto finally;
+    for (i = 0; i < 3; i++) {
+        sets[i] = buf->bits + i * buf->nwords;
+        if (fdset_Check(fdlists[i]))
+            memcpy(sets[i], ((fdset_Object *)fdlists[i])->bits,
+                   SELECT_NWORDS(nfds[i]) * sizeof(unsigned long));
+        else
+            table2set(tables[i], sets[i]);
+    }
 
-static PyMethodDef poll_methods[] = {
-    {"register",        (PyCFunction)poll_register,
-     METH_VARARGS,  poll_register_doc},
-    {"modify",          (PyCFunction)poll_modify,
-     METH_VARARGS,  poll_modify_doc},
+    keep = tvp != NULL && tvp->tv_sec == 0 &&
+        tvp->tv_usec * 1000L <= select_gil_threshold;
+#ifdef HAVE_PSELECT
+    if (mode & SELECT_PSELECT)
+        keep = select_keep_gil(tsp);
+#endif
+    SELECT_BEGIN_WAIT(keep)
+#ifdef HAVE_PSELECT
+    if (mode & SELECT_PSELECT)
+        n = pselect(max, (fd_set *)sets[0], (fd_set *)sets[1],
+                    (fd_set *)sets[2], tsp, sigmaskp);
+    else
+#endif
+    n = select(max, (fd_set *)sets[0], (fd_set *)sets[1], (fd_set *)sets[2],
+               tvp);
+    SELECT_END_WAIT
+
+#ifdef MS_WINDOWS
+    if (n == SOCKET_ERROR) {
+        PyErr_SetExcFromWindowsErr(SelectError, WSAGetLastError());
+    }
+#else
+    if (n < 0) {
+        PyErr_SetFromErrno(SelectError);
+    }
+#endif
+    else {
+        /* any of these three calls can raise an exception.  it's more
+           convenient to test for this after all three calls... but
+           is that acceptable?
+        */
+        for (i = 0; i < 3; i++) {
+            if (mode & SELECT_BITS)
+                result[i] = PyString_FromStringAndSize((char *)sets[i],
+                    SELECT_NWORDS(max) * sizeof(unsigned long));
+            else
+                result[i] = set2list(sets[i], max, tables[i]);
+        }
+        if (PyErr_Occurred())
+            ret = NULL;
+        else
+            ret = PyTuple_Pack(3, result[0], result[1], result[2]);
+
+        for (i = 0; i < 3; i++)
+            Py_XDECREF(result[i]);
+    }
+
+  finally:
+    select_buffers_put(buf);
+    return ret;
+}
+
+#if defined(HAVE_POLL) && !defined(HAVE_BROKEN_POLL)
+/*
+ * poll() support
+ */
+
+/* The array of pollfds handed to poll(2) is the registry itself: ufd_index
+   maps a descriptor to its entry, so register(), modify() and unregister()
+   patch the array in place and poll() can use it as is.  The index only
+   covers descriptors that can be open (see select_fd_in_range()); the
+   rare larger ones, which poll(2) reports as POLLNVAL, are found by a
+   linear search.
+
+   ufd_objs runs parallel to ufds and holds what poll() reports in place of
+   the descriptor: the data passed to register(), or the registered object
+   itself if the poll object was created with objects=True.  A NULL entry
+   reports the descriptor as an int.
+
+   The array is pinned while poll(2) runs with the GIL released.  A thread
+   that changes the registry in the meantime works on a private copy; the
+   polling thread frees the pinned array when it is done with it.
+
+   With epoll available, a registry that grows to ep_threshold entries is
+   mirrored into an internal epoll instance and poll() waits on that
+   instead, so the cost of a call no longer grows with the number of
+   descriptors.  The array stays the registry: register(), modify() and
+   unregister() update both.  The backend only changes at the start of
+   poll(), never under a running wait.  A descriptor epoll refuses (a
+   regular file, a closed fd: register() or modify() of it fails with
+   EBADF, where poll(2) reports POLLNVAL) sends the object back to
+   poll(2), which handles them, until it is unregistered again; it goes
+   back to poll(2) as well once the registry has shrunk to half the
+   threshold.  A process that inherits the instance over fork() builds
+   its own instead of changing the parent's.
+*/
+typedef struct {
+    PyObject_HEAD
+    struct pollfd *ufds;        /* registered descriptors, dense */
+    int ufd_len;                /* entries in use */
+    int ufd_alloc;              /* entries allocated */
+    PyObject **ufd_objs;        /* reported in place of fd, or NULL */
+    int objects;                /* report registered objects */
+    int *ufd_index;             /* fd -> entry in ufds, -1 if unused */
+    int ufd_nindex;             /* entries allocated in ufd_index */
+    int ufd_nfar;               /* entries past the index */
+    int *ufd_ready;             /* entries with revents, filled by poll() */
+    int ufd_nready;             /* entries allocated in ufd_ready */
+    struct pollfd *ufds_pinned; /* array used by a running poll(2) */
+    int polling;                /* a poll() is running */
+    int ep_threshold;           /* entries that switch to epoll, 0 never */
+#ifdef HAVE_EPOLL
+    int epfd;                   /* internal epoll instance, or -1 */
+    int ep_failed;              /* epoll refused a descriptor */
+    int *ep_refused;            /* the descriptors it refused */
+    int ep_nrefused;            /* entries used in ep_refused */
+    int ep_refused_alloc;       /* entries allocated in ep_refused */
+    struct epoll_event *ep_events; /* buffer for epoll_wait() */
+    int ep_nevents;             /* entries allocated in ep_events */
+    long ep_migrations;         /* switches to epoll */
+    long ep_reverts;            /* switches back to poll(2) */
+    pid_t ep_pid;               /* process that created epfd */
+#endif
+} pollObject;
+
+/* ep_threshold of new poll objects, see set_poll_threshold() */
+static int poll_default_threshold = 1024;
+
+static PyTypeObject poll_Type;
+
+/* Returns the entry of fd, or -1 if it isn't registered. */
+static int
+poll_find(pollObject *self, int fd)
+{
+    int i;
+
+    if (fd < self->ufd_nindex)
+        return self->ufd_index[fd];
+    for (i = 0; self->ufd_nfar > 0 && i < self->ufd_len; i++) {
+        if (self->ufds[i].fd == fd)
+            return i;
+    }
+    return -1;
+}
+
+/* Make sure the ufds array isn't the one a running poll() uses.
+   Return 1 on success, 0 on an error. */
+static int
+poll_unpin(pollObject *self)
+{
+    struct pollfd *ufds;
+
+    if (self->ufds == NULL || self->ufds != self->ufds_pinned)
+        return 1;
+    ufds = PyMem_New(struct pollfd, self->ufd_alloc);
+    if (ufds == NULL) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    memcpy(ufds, self->ufds, self->ufd_len * sizeof(struct pollfd));
+    self->ufds = ufds;
+    return 1;
+}
+
+/* Append an entry for fd.  Return 1 on success, 0 on an error. */
+static int
+poll_append(pollObject *self, int fd, short events)
+{
+    if (!poll_unpin(self))
+        return 0;
+
+    if (fd >= self->ufd_nindex && select_fd_in_range(fd)) {
+        int i, nindex = self->ufd_nindex ? 2 * self->ufd_nindex : 64;
+        int *index = self->ufd_index;
+        while (nindex <= fd)
+            nindex *= 2;
+        PyMem_Resize(index, int, nindex);
+        if (index == NULL) {
+            PyErr_NoMemory();
+            return 0;
+        }
+        for (i = self->ufd_nindex; i < nindex; i++)
+            index[i] = -1;
+        /* the limit may have been raised since entries went past it */
+        for (i = 0; self->ufd_nfar > 0 && i < self->ufd_len; i++) {
+            int ifd = self->ufds[i].fd;
+            if (ifd >= self->ufd_nindex && ifd < nindex) {
+                index[ifd] = i;
+                self->ufd_nfar--;
+            }
+        }
+        self->ufd_index = index;
+        self->ufd_nindex = nindex;
+    }
+
+    if (self->ufd_len == self->ufd_alloc) {
+        int alloc = self->ufd_alloc ? 2 * self->ufd_alloc : 8;
+        struct pollfd *ufds = self->ufds;
+        PyObject **objs = self->ufd_objs;
+        PyMem_Resize(objs, PyObject *, alloc);
+        if (objs == NULL) {
+            PyErr_NoMemory();
+            return 0;
+        }
+        self->ufd_objs = objs;
+        PyMem_Resize(ufds, struct pollfd, alloc);
+        if (ufds == NULL) {
+            PyErr_NoMemory();
+            return 0;
+        }
+        self->ufds = ufds;
+        self->ufd_alloc = alloc;
+    }
+
+    self->ufds[self->ufd_len].fd = fd;
+    self->ufds[self->ufd_len].events = events;
+    self->ufds[self->ufd_len].revents = 0;
+    self->ufd_objs[self->ufd_len] = NULL;
+    if (fd < self->ufd_nindex)
+        self->ufd_index[fd] = self->ufd_len;
+    else
+        self->ufd_nfar++;
+    self->ufd_len++;
+    return 1;
+}
+
+/* Remove entry i by moving the last entry into its place. */
+static int
+poll_remove(pollObject *self, int i)
+{
+    PyObject *obj;
+    int last;
+
+    if (!poll_unpin(self))
+        return 0;
+    obj = self->ufd_objs[i];
+    if (self->ufds[i].fd < self->ufd_nindex)
+        self->ufd_index[self->ufds[i].fd] = -1;
+    else
+        self->ufd_nfar--;
+    last = --self->ufd_len;
+    if (i != last) {
+        self->ufds[i] = self->ufds[last];
+        self->ufd_objs[i] = self->ufd_objs[last];
+        if (self->ufds[i].fd < self->ufd_nindex)
+            self->ufd_index[self->ufds[i].fd] = i;
+    }
+    Py_XDECREF(obj);
+    return 1;
+}
+
+/* Set what poll() reports for entry i; obj may be NULL. */
+static void
+poll_set_obj(pollObject *self, int i, PyObject *obj)
+{
+    PyObject *old = self->ufd_objs[i];
+
+    Py_XINCREF(obj);
+    self->ufd_objs[i] = obj;
+    Py_XDECREF(old);
+}
+
+#ifdef HAVE_EPOLL
+/* Drop an epoll instance inherited from the parent process. */
+static void
+poll_epoll_forked(pollObject *self)
+{
+    if (self->epfd >= 0 && self->ep_pid != getpid()) {
+        close(self->epfd);
+        self->epfd = -1;
+    }
+}
+
+/* Note that epoll refused fd: poll() uses poll(2) until fd is
+   unregistered.  If fd can't be recorded, until the registry shrinks. */
+static void
+poll_epoll_refuse(pollObject *self, int fd)
+{
+    int i;
+
+    self->ep_failed = 1;
+    for (i = 0; i < self->ep_nrefused; i++) {
+        if (self->ep_refused[i] == fd)
+            return;
+    }
+    if (self->ep_nrefused == self->ep_refused_alloc) {
+        int alloc = self->ep_refused_alloc ? 2 * self->ep_refused_alloc : 8;
+        int *refused = self->ep_refused;
+        PyMem_Resize(refused, int, alloc);
+        if (refused == NULL)
+            return;
+        self->ep_refused = refused;
+        self->ep_refused_alloc = alloc;
+    }
+    self->ep_refused[self->ep_nrefused++] = fd;
+}
+
+/* fd was unregistered: once no refused descriptor is left, poll() may
+   move to epoll again. */
+static void
+poll_epoll_unrefuse(pollObject *self, int fd)
+{
+    int i;
+
+    for (i = 0; i < self->ep_nrefused; i++) {
+        if (self->ep_refused[i] == fd) {
+            self->ep_refused[i] = self->ep_refused[--self->ep_nrefused];
+            if (self->ep_nrefused == 0)
+                self->ep_failed = 0;
+            return;
+        }
+    }
+}
+
+/* Apply a change of the registry to the epoll instance, if there is one.
+   The poll masks are passed through: the POLL* and EPOLL* bits have the
+   same values.  If epoll refuses the descriptor, the next poll() goes
+   back to poll(2). */
+static void
+poll_epoll_ctl(pollObject *self, int op, int fd, short events)
+{
+    struct epoll_event ev;
+
+    poll_epoll_forked(self);
+    if (self->epfd < 0)
+        return;
+    ev.events = (unsigned short)events;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    if (epoll_ctl(self->epfd, op, fd, &ev) == 0)
+        return;
+    /* a descriptor closed since it was registered is already gone */
+    if (op == EPOLL_CTL_DEL)
+        return;
+    if (op == EPOLL_CTL_MOD && errno == ENOENT)
+        op = EPOLL_CTL_ADD;
+    else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+        op = EPOLL_CTL_MOD;
+    else
+        op = -1;
+    if (op < 0 || epoll_ctl(self->epfd, op, fd, &ev) < 0)
+        poll_epoll_refuse(self, fd);
+}
+
+/* Pick the backend for the next wait; called by poll() with the GIL
+   held and no other wait running. */
+static void
+poll_epoll_switch(pollObject *self)
+{
+    int i, low = self->ep_threshold / 2;
+
+    poll_epoll_forked(self);
+    if (self->epfd >= 0) {
+        if (!self->ep_failed && self->ufd_len > low)
+            return;
+        close(self->epfd);
+        self->epfd = -1;
+        self->ep_reverts++;
+    }
+    if (self->ep_failed && self->ufd_len <= low) {
+        self->ep_failed = 0;
+        self->ep_nrefused = 0;
+    }
+    if (self->ep_threshold <= 0 || self->ep_failed ||
+        self->ufd_len < self->ep_threshold)
+        return;
+
+#ifdef EPOLL_CLOEXEC
+    self->epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    self->epfd = epoll_create(self->ufd_len);
+#endif
+    if (self->epfd < 0) {
+        self->ep_failed = 1;
+        return;
+    }
+    self->ep_pid = getpid();
+    for (i = 0; i < self->ufd_len && !self->ep_failed; i++)
+        poll_epoll_ctl(self, EPOLL_CTL_ADD, self->ufds[i].fd,
+                       self->ufds[i].events);
+    if (self->ep_failed) {
+        close(self->epfd);
+        self->epfd = -1;
+        return;
+    }
+    self->ep_migrations++;
+}
+
+/* Store the revents of the n events in ep_events in the registry and
+   their entries in ufd_ready.  Returns the number of entries stored;
+   descriptors unregistered during the wait are dropped. */
+static int
+poll_epoll_ready(pollObject *self, int n)
+{
+    int i, k, j = 0;
+
+    for (i = 0; i < n; i++) {
+        k = poll_find(self, self->ep_events[i].data.fd);
+        if (k < 0)
+            continue;
+        self->ufds[k].revents = (short)self->ep_events[i].events;
+        self->ufd_ready[j++] = k;
+    }
+    return j;
+}
+#endif /* HAVE_EPOLL */
+
+PyDoc_STRVAR(poll_register_doc,
+"register(fd [, eventmask[, data]] ) -> None\n\n\
+Register a file descriptor with the polling object.\n\
+fd -- either an integer, or an object with a fileno() method returning an\n\
+      int.\n\
+events -- an optional bitmask describing the type of events to check for\n\
+data -- an optional object that poll() returns in place of the descriptor;\n\
+        defaults to fd itself if the polling object was created with\n\
+        objects=True");
+
+static PyObject *
+poll_register(pollObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *o, *data = NULL;
+    int fd, events = POLLIN | POLLPRI | POLLOUT;
+    int i;
+    static char *kwlist[] = {"fd", "eventmask", "data", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iO:register", kwlist,
+                                     &o, &events, &data)) {
+        return NULL;
+    }
+
+    fd = PyObject_AsFileDescriptor(o);
+    if (fd == -1) return NULL;
+
+    /* Add an entry for the file descriptor, or update its event mask
+       if it is already registered. */
+    i = poll_find(self, fd);
+    if (i < 0) {
+        if (!poll_append(self, fd, (short)events))
+            return NULL;
+        i = self->ufd_len - 1;
+#ifdef HAVE_EPOLL
+        poll_epoll_ctl(self, EPOLL_CTL_ADD, fd, (short)events);
+#endif
+    }
+    else {
+        if (!poll_unpin(self))
+            return NULL;
+        self->ufds[i].events = (short)events;
+#ifdef HAVE_EPOLL
+        poll_epoll_ctl(self, EPOLL_CTL_MOD, fd, (short)events);
+#endif
+    }
+    if (data == NULL && self->objects)
+        data = o;
+    poll_set_obj(self, i, data);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(poll_modify_doc,
+"modify(fd, eventmask) -> None\n\n\
+Modify an already registered file descriptor.\n\
+fd -- either an integer, or an object with a fileno() method returning an\n\
+      int.\n\
+events -- an optional bitmask describing the type of events to check for");
+
+static PyObject *
+poll_modify(pollObject *self, PyObject *args)
+{
+    PyObject *o;
+    int fd, events;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "Oi:modify", &o, &events)) {
+        return NULL;
+    }
+
+    fd = PyObject_AsFileDescriptor(o);
+    if (fd == -1) return NULL;
+
+    /* Modify registered fd */
+    i = poll_find(self, fd);
+    if (i < 0) {
+        errno = ENOENT;
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    if (!poll_unpin(self))
+        return NULL;
+    self->ufds[i].events = (short)events;
+#ifdef HAVE_EPOLL
+    poll_epoll_ctl(self, EPOLL_CTL_MOD, fd, (short)events);
+#endif
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+PyDoc_STRVAR(poll_unregister_doc,
+"unregister(fd) -> None\n\n\
+Remove a file descriptor being tracked by the polling object.");
+
+static PyObject *
+poll_unregister(pollObject *self, PyObject *o)
+{
+    PyObject *key;
+    int fd, i;
+
+    fd = PyObject_AsFileDescriptor( o );
+    if (fd == -1)
+        return NULL;
+
+    /* Check whether the fd is already in the array */
+    i = poll_find(self, fd);
+    if (i < 0) {
+        /* Raise the KeyError the dictionary based implementation
+           raised for a file descriptor that isn't registered. */
+        key = PyInt_FromLong(fd);
+        if (key != NULL) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            Py_DECREF(key);
+        }
+        return NULL;
+    }
+    if (!poll_remove(self, i))
+        return NULL;
+#ifdef HAVE_EPOLL
+    poll_epoll_ctl(self, EPOLL_CTL_DEL, fd, 0);
+    poll_epoll_unrefuse(self, fd);
+#endif
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+PyDoc_STRVAR(poll_poll_doc,
+"poll( [timeout] ) -> list of (fd, event) 2-tuples\n\n\
+Polls the set of registered file descriptors, returning a list containing \n\
+any descriptors that have events or errors to report.\n\
+The timeout is in milliseconds; fractions are honoured where the system\n\
+can wait that precisely and are rounded up otherwise.");
+
+/* Common part of poll() and ppoll() */
+static PyObject *
+poll_internal_poll(pollObject *self, PyObject *args, int use_ppoll)
+{
+    PyObject *result_list = NULL, *tout = NULL;
+    int poll_result, i, j, k, n, nufds;
+    PyObject *value = NULL, *num = NULL;
+    struct pollfd *ufds;
+    struct timespec ts, *tsp = NULL;
+#ifdef HAVE_PPOLL
+    PyObject *signals = NULL;
+    sigset_t sigmask, *sigmaskp = NULL;
+#else
+    int timeout;
+#endif
+
+#ifdef HAVE_PPOLL
+    if (use_ppoll) {
+        if (!PyArg_UnpackTuple(args, "ppoll", 0, 2, &tout, &signals))
+            return NULL;
+    }
+    else
+#endif
+    if (!PyArg_UnpackTuple(args, "poll", 0, 1, &tout)) {
+        return NULL;
+    }
+
+    /* Check values for timeout: milliseconds, fractions allowed and
+       rounded up; negative waits forever */
+    if (tout != NULL && tout != Py_None) {
+        if (!PyNumber_Check(tout)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "timeout must be an integer or None");
+            return NULL;
+        }
+        if (select_timespec(tout, 1E-3, &ts) < 0)
+            return NULL;
+        if (ts.tv_sec >= 0)
+            tsp = &ts;
+    }
+#ifndef HAVE_PPOLL
+    timeout = select_timespec_ms(tsp);
+#endif
+
+#ifdef HAVE_PPOLL
+    if (signals != NULL && signals != Py_None) {
+        if (select_sigmask(signals, &sigmask) < 0)
+            return NULL;
+        sigmaskp = &sigmask;
+    }
+#endif
+
+    if (self->polling) {
+        PyErr_SetString(PyExc_RuntimeError, "concurrent poll() invocation");
+        return NULL;
+    }
+    if (self->ufd_nready <= self->ufd_len) {
+        /* one spare entry covers the single event epoll_wait() may
+           report on an empty registry */
+        int *ready = self->ufd_ready;
+        PyMem_Resize(ready, int, self->ufd_alloc + 1);
+        if (ready == NULL)
+            return PyErr_NoMemory();
+        self->ufd_ready = ready;
+        self->ufd_nready = self->ufd_alloc + 1;
+    }
+    nufds = self->ufd_len;
+
+#ifdef HAVE_EPOLL
+    poll_epoll_switch(self);
+    if (self->epfd >= 0) {
+        int epfd = self->epfd, maxevents = nufds > 0 ? nufds : 1;
+        struct epoll_event *events = self->ep_events;
+
+        if (self->ep_nevents < maxevents) {
+            PyMem_Resize(events, struct epoll_event, self->ufd_alloc + 1);
+            if (events == NULL)
+                return PyErr_NoMemory();
+            self->ep_events = events;
+            self->ep_nevents = self->ufd_alloc + 1;
+        }
+
+        /* the registry may grow or move while we wait; the entries are
+           looked up again from the reported descriptors afterwards */
+        self->polling = 1;
+        SELECT_BEGIN_WAIT(select_keep_gil(tsp))
+#ifdef HAVE_PPOLL
+        poll_result = select_epoll_wait(epfd, events, maxevents, tsp,
+                                        sigmaskp);
+#else
+        poll_result = select_epoll_wait(epfd, events, maxevents, tsp,
+                                        NULL);
+#endif
+        SELECT_END_WAIT
+        self->polling = 0;
+
+        ufds = self->ufds;
+        if (poll_result > 0)
+            poll_result = poll_epoll_ready(self, poll_result);
+    }
+    else
+#endif /* HAVE_EPOLL */
+    {
+        /* call poll() on the registry, pinned so that other threads
+           leave it alone, and collect the fired entries before taking
+           the GIL back */
+        ufds = self->ufds_pinned = self->ufds;
+        self->polling = 1;
+        SELECT_BEGIN_WAIT(select_keep_gil(tsp))
+#ifdef HAVE_PPOLL
+        poll_result = ppoll(ufds, nufds, tsp, sigmaskp);
+#else
+        poll_result = poll(ufds, nufds, timeout);
+#endif
+        if (poll_result > 0)
+            poll_result = pollscan(ufds, nufds, self->ufd_ready,
+                                   poll_result);
+        SELECT_END_WAIT
+        self->polling = 0;
+        self->ufds_pinned = NULL;
+    }
+
+    if (poll_result < 0) {
+        PyErr_SetFromErrno(SelectError);
+        goto error;
+    }
+
+    /* build the result list */
+
+    result_list = PyList_New(poll_result);
+    if (!result_list)
+        goto error;
+    else {
+        for (j = 0, n = 0; n < poll_result; n++) {
+            i = self->ufd_ready[n];
+            /* the registry may have changed while we were polling;
+               descriptors unregistered meanwhile are dropped */
+            k = (ufds == self->ufds) ? i : poll_find(self, ufds[i].fd);
+            if (k < 0)
+                continue;
+            /* if we hit a NULL return, set value to NULL
+               and break out of loop; code at end will
+               clean up result_list */
+            value = PyTuple_New(2);
+            if (value == NULL)
+                goto error;
+            num = self->ufd_objs[k];
+            if (num != NULL)
+                Py_INCREF(num);
+            else
+                num = PyInt_FromLong(ufds[i].fd);
+            if (num == NULL) {
+                Py_DECREF(value);
+                goto error;
+            }
+            PyTuple_SET_ITEM(value, 0, num);
+
+            /* The &0xffff is a workaround for AIX.  'revents'
+               is a 16-bit short, and IBM assigned POLLNVAL
+               to be 0x8000, so the conversion to int results
+               in a negative number. See SF bug #923315. */
+            num = PyInt_FromLong(ufds[i].revents & 0xffff);
+            if (num == NULL) {
+                Py_DECREF(value);
+                goto error;
+            }
+            PyTuple_SET_ITEM(value, 1, num);
+            PyList_SET_ITEM(result_list, j, value);
+            j++;
+        }
+        if (j < poll_result &&
+            PyList_SetSlice(result_list, j, poll_result, NULL) < 0)
+            goto error;
+    }
+    if (ufds != self->ufds)
+        PyMem_Free(ufds);           /* replaced while we were polling */
+    return result_list;
+
+  error:
+    Py_XDECREF(result_list);
+    if (ufds != self->ufds)
+        PyMem_Free(ufds);
+    return NULL;
+}
+
+static PyObject *
+poll_poll(pollObject *self, PyObject *args)
+{
+    return poll_internal_poll(self, args, 0);
+}
+
+#ifdef HAVE_PPOLL
+PyDoc_STRVAR(poll_ppoll_doc,
+"ppoll( [timeout[, sigmask]] ) -> list of (fd, event) 2-tuples\n\n\
+Like poll(), but backed by ppoll(2). The timeout in milliseconds may be\n\
+a float and is honoured to the nanosecond. sigmask is an iterable of\n\
+signal numbers that are unblocked atomically for the duration of the\n\
+wait; None leaves the signal mask alone.");
+
+static PyObject *
+poll_ppoll(pollObject *self, PyObject *args)
+{
+    return poll_internal_poll(self, args, 1);
+}
+#endif /* HAVE_PPOLL */
+
+PyDoc_STRVAR(poll_stats_doc,
+"stats() -> dict\n\n\
+Return the backend the polling object uses, 'poll' or 'epoll', with the\n\
+number of registered descriptors, the threshold at which it moves to\n\
+epoll and how often it has moved to epoll and back.");
+
+static PyObject *
+poll_stats(pollObject *self)
+{
+    const char *backend = "poll";
+    long migrations = 0, reverts = 0;
+
+#ifdef HAVE_EPOLL
+    if (self->epfd >= 0)
+        backend = "epoll";
+    migrations = self->ep_migrations;
+    reverts = self->ep_reverts;
+#endif
+    return Py_BuildValue("{s:s,s:i,s:i,s:l,s:l}",
+                         "backend", backend,
+                         "registered", self->ufd_len,
+                         "threshold", self->ep_threshold,
+                         "migrations", migrations,
+                         "reverts", reverts);
+}
+
+static PyMethodDef poll_methods[] = {
+    {"register",        (PyCFunction)poll_register,
+     METH_VARARGS | METH_KEYWORDS,  poll_register_doc},
+    {"modify",          (PyCFunction)poll_modify,
+     METH_VARARGS,  poll_modify_doc},
     {"unregister",      (PyCFunction)poll_unregister,
      METH_O,        poll_unregister_doc},
     {"poll",            (PyCFunction)poll_poll,
      METH_VARARGS,  poll_poll_doc},
+#ifdef HAVE_PPOLL
+    {"ppoll",           (PyCFunction)poll_ppoll,
+     METH_VARARGS,  poll_ppoll_doc},
+#endif /* HAVE_PPOLL */
+    {"stats",           (PyCFunction)poll_stats,
+     METH_NOARGS,   poll_stats_doc},
     {NULL,              NULL}           /* sentinel */
 };
 
-static pollObject *
-newPollObject(void)
+static pollObject *
+newPollObject(int objects, int threshold)
+{
+    pollObject *self;
+    self = PyObject_GC_New(pollObject, &poll_Type);
+    if (self == NULL)
+        return NULL;
+    self->ufds = NULL;
+    self->ufd_len = self->ufd_alloc = 0;
+    self->ufd_index = NULL;
+    self->ufd_nindex = 0;
+    self->ufd_nfar = 0;
+    self->ufds_pinned = NULL;
+    self->ufd_objs = NULL;
+    self->ufd_ready = NULL;
+    self->ufd_nready = 0;
+    self->objects = objects;
+    self->polling = 0;
+    self->ep_threshold = threshold;
+#ifdef HAVE_EPOLL
+    self->epfd = -1;
+    self->ep_failed = 0;
+    self->ep_refused = NULL;
+    self->ep_nrefused = self->ep_refused_alloc = 0;
+    self->ep_events = NULL;
+    self->ep_nevents = 0;
+    self->ep_migrations = self->ep_reverts = 0;
+    self->ep_pid = 0;
+#endif
+    PyObject_GC_Track(self);
+    return self;
+}
+
+static int
+poll_traverse(pollObject *self, visitproc visit, void *arg)
+{
+    int i;
+
+    for (i = 0; i < self->ufd_len; i++)
+        Py_VISIT(self->ufd_objs[i]);
+    return 0;
+}
+
+static int
+poll_tp_clear(pollObject *self)
+{
+    int i;
+
+    for (i = 0; i < self->ufd_len; i++)
+        Py_CLEAR(self->ufd_objs[i]);
+    return 0;
+}
+
+static void
+poll_dealloc(pollObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    poll_tp_clear(self);
+    if (self->ufds != NULL)
+        PyMem_DEL(self->ufds);
+    if (self->ufd_index != NULL)
+        PyMem_DEL(self->ufd_index);
+    if (self->ufd_objs != NULL)
+        PyMem_DEL(self->ufd_objs);
+    if (self->ufd_ready != NULL)
+        PyMem_DEL(self->ufd_ready);
+#ifdef HAVE_EPOLL
+    if (self->epfd >= 0)
+        close(self->epfd);
+    if (self->ep_events != NULL)
+        PyMem_DEL(self->ep_events);
+    if (self->ep_refused != NULL)
+        PyMem_DEL(self->ep_refused);
+#endif
+    PyObject_GC_Del(self);
+}
+
+static PyObject *
+poll_getattr(pollObject *self, char *name)
+{
+    return Py_FindMethod(poll_methods, (PyObject *)self, name);
+}
+
+static PyTypeObject poll_Type = {
+    /* The ob_type field must be initialized in the module init function
+     * to be portable to Windows without using C++. */
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "select_backport.poll",              /*tp_name*/
+    sizeof(pollObject),         /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    /* methods */
+    (destructor)poll_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    (getattrfunc)poll_getattr, /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash*/
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    0,                          /*tp_doc*/
+    (traverseproc)poll_traverse, /*tp_traverse*/
+    (inquiry)poll_tp_clear,     /*tp_clear*/
+};
+
+PyDoc_STRVAR(poll_doc,
+"poll([objects=False[, threshold]]) -> polling object\n\
+\n\
+Returns a polling object, which supports registering and\n\
+unregistering file descriptors, and then polling them for I/O events.\n\
+If objects is true, poll() returns the objects passed to register()\n\
+instead of their descriptors.\n\
+Where epoll is available, a polling object with threshold or more\n\
+descriptors waits on an internal epoll instance instead of poll(2);\n\
+0 disables that. The default is set by set_poll_threshold().");
+
+PyDoc_STRVAR(set_poll_threshold_doc,
+"set_poll_threshold(n) -> int\n\
+\n\
+Set the threshold of polling objects created from now on and return the\n\
+previous value. See poll().");
+
+static PyObject *
+select_set_poll_threshold(PyObject *self, PyObject *args)
+{
+    int threshold, old = poll_default_threshold;
+
+    if (!PyArg_ParseTuple(args, "i:set_poll_threshold", &threshold))
+        return NULL;
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must not be negative");
+        return NULL;
+    }
+    poll_default_threshold = threshold;
+    return PyInt_FromLong(old);
+}
+
+PyDoc_STRVAR(pollscan_doc,
+"_pollscan([name]) -> name\n\
+\n\
+Return the name of the routine poll() uses to find the fired entries:\n\
+'avx2', 'sse2' or 'scalar'. If name is given, switch to it first.\n\
+Meant for tests and benchmarks.");
+
+static PyObject *
+select_pollscan(PyObject *self, PyObject *args)
+{
+    const char *name = NULL;
+
+    if (!PyArg_ParseTuple(args, "|s:_pollscan", &name))
+        return NULL;
+    if (name != NULL && pollscan_select(name) < 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "scan routine '%.100s' isn't available", name);
+        return NULL;
+    }
+    return PyString_FromString(pollscan_name);
+}
+
+static PyObject *
+select_poll(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    int objects = 0, threshold = poll_default_threshold;
+    static char *kwlist[] = {"objects", "threshold", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii:poll", kwlist,
+                                     &objects, &threshold))
+        return NULL;
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must not be negative");
+        return NULL;
+    }
+    return (PyObject *)newPollObject(objects, threshold);
+}
+
+#ifdef __APPLE__
+/*
+ * On some systems poll() sets errno on invalid file descriptors. We test
+ * for this at runtime because this bug may be fixed or introduced between
+ * OS releases.
+ */
+static int select_have_broken_poll(void)
+{
+    int poll_test;
+    int filedes[2];
+
+    struct pollfd poll_struct = { 0, POLLIN|POLLPRI|POLLOUT, 0 };
+
+    /* Create a file descriptor to make invalid */
+    if (pipe(filedes) < 0) {
+        return 1;
+    }
+    poll_struct.fd = filedes[0];
+    close(filedes[0]);
+    close(filedes[1]);
+    poll_test = poll(&poll_struct, 1, 0);
+    if (poll_test < 0) {
+        return 1;
+    } else if (poll_test == 0 && poll_struct.revents != POLLNVAL) {
+        return 1;
+    }
+    return 0;
+}
+#endif /* __APPLE__ */
+
+#endif /* HAVE_POLL */
+
+#ifdef HAVE_EPOLL
+/* **************************************************************************
+ *                      epoll interface for Linux 2.6
+ *
+ * Written by Christian Heimes
+ * Inspired by Twisted's _epoll.pyx and select.poll()
+ */
+
+/* What the epoll object knows about a registered descriptor.  The table
+   is indexed by fd, so poll() finds the data of an event without hashing.
+   It mirrors the interest set as far as it went through this object:
+   modify() skips epoll_ctl() when the mask doesn't change, and len(),
+   `in`, iteration and get_mask() are answered from it.  A descriptor
+   closed without unregister() stays in the mirror until it is
+   unregistered, forgotten or registered again.
+
+   The kernel's epoll_data carries the fd in its low 32 bits and the
+   generation of the registration in the high ones.  Every register()
+   and forget() starts a new generation, and poll() drops the events
+   tagged with an older one: those of a descriptor that was closed
+   without unregister() while another open file still referred to it,
+   which the kernel keeps reporting under the old fd number.  Generation
+   0 means the fd was never registered through this object (an epoll fd
+   shared with fromfd(), say); its events are always reported.  No
+   epoll_ctl() reaches such a leftover once its fd number is closed or
+   reused, so it lives on until its file is closed; a poll() that only
+   gets leftovers waits again for the rest of its timeout.
+
+   A oneshot registration is armed while the kernel may report it.  poll()
+   disarms it when it returns its event, and done() queues the rearm, a
+   MOD to the registered mask, for the next poll(): threads handling
+   different fds of one object batch their rearms into one release of the
+   GIL, and a done() for an armed or already queued fd is a no-op.  The
+   queue is the changes list of deferred mode; the GIL serializes done()
+   calls, so the threads need no lock of their own.  armed is set before
+   epoll_ctl() releases the GIL, so an event a concurrent poll() returns
+   right away disarms it for good.
+
+   In sticky mode every registration is edge-triggered, and the events
+   poll() gets from the kernel are kept in revents and on the ready list.
+   poll() reports the ready list until mark_drained() clears an fd, which
+   the application does when a read or write returns EAGAIN: the
+   behaviour of level-triggered epoll without the kernel checking every
+   ready fd again on each wait.  A new edge after the drain puts the fd
+   back.
+
+   A registration with a priority above 0 goes to the epoll instance of
+   its class, which is itself registered in epfd, so a wait on epfd wakes
+   up for every class.  poll() takes the events of the classes from the
+   highest down, each up to its budget, and those of class 0 (epfd) last;
+   see pyepoll_wait_classes().
+
+   In deferred mode the mirror is updated right away but the kernel only
+   at the next poll() or flush(): changed descriptors are queued once in
+   changes, and the flush compares what the mirror wants with what the
+   kernel was last given (kevents, kregistered).  So an add and a delete
+   in between cancel out, and repeated modifications issue one MOD. */
+typedef struct {
+    PyObject *data;                     /* reported in place of fd, or NULL */
+    unsigned int events;                /* registered mask */
+    int registered;
+    unsigned int gen;                   /* generation of the registration */
+    unsigned int kevents;               /* mask the kernel has */
+    int kregistered;                    /* the kernel has fd */
+    int dirty;                          /* fd is in changes */
+    int rearm;                          /* MOD even if unchanged */
+    int armed;                          /* oneshot: the kernel may report */
+    unsigned int revents;               /* sticky: events not drained */
+    int inready;                        /* sticky: position in ready + 1 */
+    int priority;                       /* class of the registration */
+    int kpriority;                      /* class the kernel has fd in */
+} pyepoll_slot;
+
+/* Busy polling parameters of an epoll instance (Linux 6.9), for headers
+   that don't have them yet */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS            _IOW(0x8A, 0x01, struct epoll_params)
+#define EPIOCGPARAMS            _IOR(0x8A, 0x02, struct epoll_params)
+#endif
+
+/* Priority classes, 0 (the default) to PYEPOLL_NCLASSES - 1 */
+#define PYEPOLL_NCLASSES        4
+
+typedef struct {
+    PyObject_HEAD
+    SOCKET epfd;                        /* epoll control file descriptor */
+    pyepoll_slot *slots;                /* fd -> registration */
+    int nslots;                         /* entries allocated in slots */
+    int nregistered;                    /* slots with registered set */
+    int deferred;                       /* queue changes until poll() */
+    int *changes;                       /* dirty descriptors */
+    int nchanges;                       /* entries used in changes */
+    int changes_alloc;                  /* entries allocated in changes */
+    int sticky;                         /* report events until drained */
+    int *ready;                         /* sticky: fds with revents */
+    int nready;                         /* entries used in ready */
+    int ready_alloc;                    /* entries allocated in ready */
+    int ready_next;                     /* sticky: where poll() starts */
+    int classfd[PYEPOLL_NCLASSES];      /* epoll fd of a class, -1 if none;
+                                           [0] is unused: class 0 is epfd */
+    int budget[PYEPOLL_NCLASSES];       /* events of a class per poll(),
+                                           -1 for no limit */
+    int nclasses;                       /* classes above 0 with an fd */
+    int running;                        /* in run() */
+    int stopping;                       /* stop() was called */
+    int wakefd;                         /* eventfd stop() wakes run() with,
+                                           registered in epfd, or -1 */
+    long spin;                          /* ns to spin before blocking */
+    unsigned long spin_hits;            /* spins that found events */
+    unsigned long spin_misses;          /* spins that had to block */
+    struct epoll_event *evs;            /* cached event buffer, or NULL */
+    int nevs;                           /* entries allocated in evs */
+    int adaptive;                       /* size batches from the load */
+    int batch;                          /* maxevents of an adaptive poll() */
+    int idle;                           /* light polls since the last resize */
+    int pending;                        /* the last poll() filled its buffer */
+} pyEpoll_Object;
+
+/* Limits of the adaptive batch size.  A poll() that fills the batch
+   doubles it; PYEPOLL_IDLE_POLLS in a row that use less than a quarter
+   of it halve it. */
+#define PYEPOLL_BATCH_MIN       16
+#define PYEPOLL_BATCH_INITIAL   64
+#define PYEPOLL_BATCH_MAX       65536
+#define PYEPOLL_IDLE_POLLS      8
+
+/* epoll_data of a registration, and its parts */
+#define PYEPOLL_TAG(fd, gen)    (((uint64_t)(gen) << 32) | (unsigned int)(fd))
+#define PYEPOLL_TAG_FD(tag)     ((int)(unsigned int)(tag))
+#define PYEPOLL_TAG_GEN(tag)    ((unsigned int)((tag) >> 32))
+
+static PyTypeObject pyEpoll_Type;
+#define pyepoll_CHECK(op) (PyObject_TypeCheck((op), &pyEpoll_Type))
+
+static PyObject *
+pyepoll_err_closed(void)
+{
+    PyErr_SetString(PyExc_ValueError, "I/O operation on closed epoll fd");
+    return NULL;
+}
+
+/* The event buffer of poll().  The cached buffer is taken out of the
+   object for the duration of a call, so a thread that finds it missing
+   (another thread is waiting with it) allocates a private one.  Returns
+   NULL with MemoryError set on failure. */
+static struct epoll_event *
+pyepoll_get_events(pyEpoll_Object *self, int maxevents, int *nevs)
+{
+    struct epoll_event *evs = self->evs, *resized;
+
+    *nevs = self->nevs;
+    self->evs = NULL;
+    self->nevs = 0;
+    if (evs == NULL || *nevs < maxevents) {
+        resized = evs;
+        PyMem_Resize(resized, struct epoll_event, maxevents);
+        if (resized == NULL) {
+            PyMem_Free(evs);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        evs = resized;
+        *nevs = maxevents;
+    }
+    return evs;
+}
+
+/* Hand a buffer back; it becomes the cached one unless the object has
+   one again or was closed meanwhile. */
+static void
+pyepoll_put_events(pyEpoll_Object *self, struct epoll_event *evs, int nevs)
+{
+    if (self->evs == NULL && self->epfd >= 0) {
+        self->evs = evs;
+        self->nevs = nevs;
+    }
+    else {
+        PyMem_Free(evs);
+    }
+}
+
+/* Take up to maxevents events from the classes above 0, the highest
+   first, each up to its budget, and append them to evs[0..n).  Returns
+   the new number of events in evs, or -1 with errno set. */
+static int
+pyepoll_wait_children(const int *classfd, const int *budget,
+                      struct epoll_event *evs, int n, int maxevents)
+{
+    int priority, k, nfds;
+
+    for (priority = PYEPOLL_NCLASSES - 1; priority > 0 && n < maxevents;
+         priority--) {
+        if (classfd[priority] < 0)
+            continue;
+        k = maxevents - n;
+        if (budget[priority] >= 0 && budget[priority] < k)
+            k = budget[priority];
+        nfds = epoll_wait(classfd[priority], evs + n, k, 0);
+        if (nfds < 0)
+            return -1;
+        n += nfds;
+    }
+    return n;
+}
+
+/* Wait on epfd and return up to maxevents events of all classes, the
+   higher ones first, in evs, which has room for 2 * maxevents; the upper
+   half holds the events of epfd meanwhile.  Runs without the GIL on
+   copies of classfd and budget.  Returns the number of events, or -1
+   with errno set.
+
+   The ready classes are drained before the wait, which then doesn't
+   block.  Otherwise epfd reports a class that becomes ready while it
+   waits, and the classes are drained after it; their events still go
+   before those of class 0. */
+static int
+pyepoll_wait_classes(int epfd, const int *classfd, const int *budget,
+                     struct epoll_event *evs, int maxevents,
+                     struct timespec *tsp)
+{
+    struct timespec zero;
+    struct epoll_event *base = evs + maxevents;
+    int n, nbase = 0, room, i, j, priority, woken = 0, first;
+
+    n = pyepoll_wait_children(classfd, budget, evs, 0, maxevents);
+    if (n < 0)
+        return -1;
+    first = n;
+    room = maxevents - n;
+    if (budget[0] >= 0 && budget[0] < room)
+        room = budget[0];
+    if (room > 0) {
+        zero.tv_sec = zero.tv_nsec = 0;
+        nbase = select_epoll_wait(epfd, base, room, n ? &zero : tsp, NULL);
+        if (nbase < 0)
+            return -1;
+    }
+    /* leave out the class instances themselves */
+    for (i = j = 0; i < nbase; i++) {
+        int fd = PYEPOLL_TAG_FD(base[i].data.u64);
+        for (priority = 1; priority < PYEPOLL_NCLASSES; priority++) {
+            if (classfd[priority] == fd)
+                break;
+        }
+        if (priority < PYEPOLL_NCLASSES)
+            woken = 1;
+        else
+            base[j++] = base[i];
+    }
+    if (!woken || first > 0) {
+        memcpy(evs + n, base, j * sizeof(struct epoll_event));
+        return n + j;
+    }
+    n = pyepoll_wait_children(classfd, budget, evs, 0, maxevents - j);
+    if (n < 0)
+        return -1;
+    memcpy(evs + n, base, j * sizeof(struct epoll_event));
+    return n + j;
+}
+
+/* Room pyepoll_wait() needs in evs for maxevents events. */
+static int
+pyepoll_events_needed(pyEpoll_Object *self, int maxevents)
+{
+    return self->nclasses ? 2 * maxevents : maxevents;
+}
+
+/* Wait for up to maxevents events with the GIL released, unless the
+   timeout is short enough to keep it.  Returns their number, or -1 with
+   errno set. */
+static int
+pyepoll_wait(pyEpoll_Object *self, struct epoll_event *evs, int maxevents,
+             struct timespec *tsp)
+{
+    int classfd[PYEPOLL_NCLASSES], budget[PYEPOLL_NCLASSES];
+    int epfd = self->epfd, nfds;
+
+    if (self->nclasses == 0) {
+        SELECT_BEGIN_WAIT(select_keep_gil(tsp))
+        nfds = select_epoll_wait(epfd, evs, maxevents, tsp, NULL);
+        SELECT_END_WAIT
+        return nfds;
+    }
+    memcpy(classfd, self->classfd, sizeof(classfd));
+    memcpy(budget, self->budget, sizeof(budget));
+    SELECT_BEGIN_WAIT(select_keep_gil(tsp))
+    nfds = pyepoll_wait_classes(epfd, classfd, budget, evs, maxevents, tsp);
+    SELECT_END_WAIT
+    return nfds;
+}
+
+/* Spin with the GIL held, checking for events without waiting, for up to
+   ns nanoseconds: a wait that blocks costs a wakeup, tens of microseconds,
+   when the events come.  Returns the number of events, 0 if there were
+   none, or -1 with errno set. */
+static int
+pyepoll_spin(pyEpoll_Object *self, struct epoll_event *evs, int maxevents,
+             long ns)
+{
+    struct timespec start, now, zero;
+    int nfds;
+
+    zero.tv_sec = zero.tv_nsec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        if (self->nclasses)
+            nfds = pyepoll_wait_classes(self->epfd, self->classfd,
+                                        self->budget, evs, maxevents, &zero);
+        else
+            nfds = epoll_wait(self->epfd, evs, maxevents, 0);
+        if (nfds != 0)
+            return nfds;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L +
+             (now.tv_nsec - start.tv_nsec) < ns);
+    return 0;
+}
+
+/* Record the outcome of a wait for maxevents events that returned nfds:
+   set the pending flag and, for an adaptive batch, resize it. */
+static void
+pyepoll_account(pyEpoll_Object *self, int nfds, int maxevents, int batched)
+{
+    self->pending = (nfds == maxevents);
+    if (!batched || nfds < 0)
+        return;
+    if (nfds == maxevents) {
+        if (self->batch < PYEPOLL_BATCH_MAX)
+            self->batch *= 2;
+        self->idle = 0;
+    }
+    else if (nfds < self->batch / 4) {
+        if (++self->idle >= PYEPOLL_IDLE_POLLS) {
+            if (self->batch > PYEPOLL_BATCH_MIN)
+                self->batch /= 2;
+            self->idle = 0;
+        }
+    }
+    else {
+        self->idle = 0;
+    }
+}
+
+/* Make the slot table cover fd.  Returns -1 with an exception set on
+   failure: IOError(EBADF) for a descriptor past RLIMIT_NOFILE, which
+   can't be open and would make the table huge, MemoryError otherwise. */
+static int
+pyepoll_reserve(pyEpoll_Object *self, int fd)
+{
+    int nslots = self->nslots ? self->nslots : 64;
+    pyepoll_slot *slots = self->slots;
+
+    if (fd < self->nslots)
+        return 0;
+    if (!select_fd_in_range(fd)) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    while (nslots <= fd)
+        nslots *= 2;
+    PyMem_Resize(slots, pyepoll_slot, nslots);
+    if (slots == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(slots + self->nslots, 0,
+           (nslots - self->nslots) * sizeof(pyepoll_slot));
+    self->slots = slots;
+    self->nslots = nslots;
+    return 0;
+}
+
+/* Set the data reported for fd, which the table must cover; data may be
+   NULL. */
+static void
+pyepoll_set_data(pyEpoll_Object *self, int fd, PyObject *data)
+{
+    PyObject *old = self->slots[fd].data;
+
+    Py_XINCREF(data);
+    self->slots[fd].data = data;
+    Py_XDECREF(old);
+}
+
+/* The data registered for fd, borrowed, or NULL to report the fd. */
+static PyObject *
+pyepoll_get_data(pyEpoll_Object *self, int fd)
+{
+    if (fd < 0 || fd >= self->nslots)
+        return NULL;
+    return self->slots[fd].data;
+}
+
+/* The generation epoll_ctl(op) tags fd with: a new one for ADD, the
+   current one otherwise.  The table must cover fd. */
+static unsigned int
+pyepoll_next_gen(pyEpoll_Object *self, int op, int fd)
+{
+    unsigned int gen = self->slots[fd].gen;
+
+    if (op != EPOLL_CTL_ADD)
+        return gen;
+    return gen + 1 ? gen + 1 : 1;       /* 0 is never used */
+}
+
+/* Events of an older generation of their fd, see pyepoll_slot. */
+static int
+pyepoll_stale(pyEpoll_Object *self, uint64_t tag)
+{
+    int fd = PYEPOLL_TAG_FD(tag);
+
+    if (fd < 0 || fd >= self->nslots || self->slots[fd].gen == 0)
+        return 0;
+    return self->slots[fd].gen != PYEPOLL_TAG_GEN(tag);
+}
+
+/* Drop the wakeup of stop() from evs[0..nfds) in place and drain the
+   eventfd.  Returns how many events are left and sets *woken if there
+   was one. */
+static int
+pyepoll_unwake(pyEpoll_Object *self, struct epoll_event *evs, int nfds,
+               int *woken)
+{
+    uint64_t tag, count;
+    int i, n;
+
+    if (self->wakefd < 0)
+        return nfds;
+    tag = PYEPOLL_TAG(self->wakefd, 0);
+    for (i = n = 0; i < nfds; i++) {
+        if (evs[i].data.u64 == tag) {
+            *woken = 1;
+            while (read(self->wakefd, &count, sizeof(count)) > 0)
+                ;
+            continue;
+        }
+        if (n != i)
+            evs[n] = evs[i];
+        n++;
+    }
+    return n;
+}
+
+/* Drop the stale events of evs[0..nfds) in place and disarm the oneshot
+   registrations of the others.  Returns how many are left, in their
+   order. */
+static int
+pyepoll_live(pyEpoll_Object *self, struct epoll_event *evs, int nfds)
+{
+    int i, n, fd;
+
+    for (i = n = 0; i < nfds; i++) {
+        if (pyepoll_stale(self, evs[i].data.u64))
+            continue;
+        fd = PYEPOLL_TAG_FD(evs[i].data.u64);
+        if (fd >= 0 && fd < self->nslots)
+            self->slots[fd].armed = 0;
+        if (n != i)
+            evs[n] = evs[i];
+        n++;
+    }
+    return n;
+}
+
+/* Add events to the undrained ones of fd, which the table must cover.
+   Returns -1 with MemoryError set on failure. */
+static int
+pyepoll_set_ready(pyEpoll_Object *self, int fd, unsigned int events)
+{
+    pyepoll_slot *slot = &self->slots[fd];
+
+    if (!slot->inready) {
+        if (self->nready == self->ready_alloc) {
+            int alloc = self->ready_alloc ? 2 * self->ready_alloc : 64;
+            int *ready = self->ready;
+            PyMem_Resize(ready, int, alloc);
+            if (ready == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            self->ready = ready;
+            self->ready_alloc = alloc;
+        }
+        self->ready[self->nready++] = fd;
+        slot->inready = self->nready;
+    }
+    slot->revents |= events;
+    return 0;
+}
+
+/* Clear events of fd; it leaves the ready list with the last of them. */
+static void
+pyepoll_clear_ready(pyEpoll_Object *self, int fd, unsigned int events)
+{
+    pyepoll_slot *slot;
+    int pos, last;
+
+    if (fd < 0 || fd >= self->nslots || !self->slots[fd].inready)
+        return;
+    slot = &self->slots[fd];
+    slot->revents &= ~events;
+    if (slot->revents)
+        return;
+    pos = slot->inready - 1;
+    last = self->ready[--self->nready];
+    if (pos != self->nready) {
+        self->ready[pos] = last;
+        self->slots[last].inready = pos + 1;
+    }
+    slot->inready = 0;
+}
+
+/* Sticky mode: merge the nfds events the kernel returned in evs into the
+   ready list and replace them with up to maxevents entries of the list,
+   taking turns from one call to the next.  Returns the number of events
+   in evs, or -1 with MemoryError set. */
+static int
+pyepoll_collect(pyEpoll_Object *self, struct epoll_event *evs, int nfds,
+                int maxevents)
+{
+    int i, n, start, fd;
+
+    for (i = 0; i < nfds; i++) {
+        fd = PYEPOLL_TAG_FD(evs[i].data.u64);
+        if (fd < 0)
+            continue;
+        if (pyepoll_reserve(self, fd) < 0 ||
+            pyepoll_set_ready(self, fd, evs[i].events) < 0)
+            return -1;
+    }
+    n = self->nready < maxevents ? self->nready : maxevents;
+    start = self->nready ? self->ready_next % self->nready : 0;
+    for (i = 0; i < n; i++) {
+        fd = self->ready[(start + i) % self->nready];
+        evs[i].events = self->slots[fd].revents;
+        evs[i].data.u64 = PYEPOLL_TAG(fd, self->slots[fd].gen);
+    }
+    self->ready_next = start + n;
+    if (self->nready > n)
+        self->pending = 1;
+    return n;
+}
+
+/* Record a successful epoll_ctl() in the mirror.  A new registration
+   starts a generation and has no data; modify() keeps the data unless it
+   is given. */
+static void
+pyepoll_applied(pyEpoll_Object *self, int op, int fd, unsigned int events,
+                PyObject *data)
+{
+    pyepoll_slot *slot;
+
+    if (fd >= self->nslots)
+        return;                         /* DEL of a descriptor never seen */
+    slot = &self->slots[fd];
+    if (op == EPOLL_CTL_DEL) {
+        if (slot->registered)
+            self->nregistered--;
+        slot->registered = 0;
+        slot->events = 0;
+        slot->armed = 0;
+        pyepoll_clear_ready(self, fd, ~0U);
+        pyepoll_set_data(self, fd, NULL);
+    }
+    else {
+        if (!slot->registered)
+            self->nregistered++;
+        if (op == EPOLL_CTL_ADD)
+            slot->gen = pyepoll_next_gen(self, op, fd);
+        slot->registered = 1;
+        slot->events = events;
+        /* sticky: events no longer asked for aren't reported either */
+        pyepoll_clear_ready(self, fd, ~(events | EPOLLERR | EPOLLHUP));
+        if (data != NULL || op == EPOLL_CTL_ADD)
+            pyepoll_set_data(self, fd, data);
+    }
+    if (!self->deferred) {
+        /* the kernel has it already */
+        slot->kregistered = slot->registered;
+        slot->kevents = slot->events;
+        slot->kpriority = slot->priority;
+    }
+}
+
+/* Masks that modify() rearms even when they don't change: oneshot, and
+   edge-triggered, which reports readiness still pending again. */
+#ifdef EPOLLONESHOT
+#define PYEPOLL_REARMS(events)  ((events) & (EPOLLONESHOT | EPOLLET))
+#else
+#define PYEPOLL_REARMS(events)  ((events) & EPOLLET)
+#endif
+
+/* Mark fd armed if epoll_ctl(op) with events arms it; called before the
+   system call, see pyepoll_slot.  The table must cover fd. */
+static void
+pyepoll_arm(pyEpoll_Object *self, int op, int fd, unsigned int events)
+{
+#ifdef EPOLLONESHOT
+    self->slots[fd].armed = op != EPOLL_CTL_DEL && (events & EPOLLONESHOT);
+#endif
+}
+
+/* True if modifying fd to events wouldn't change anything: the kernel is
+   known to have that very registration.  A oneshot or edge-triggered one
+   is never skipped, modify() is how it is rearmed.  Neither is one with
+   a change queued, or one moving to another class. */
+static int
+pyepoll_unchanged(pyEpoll_Object *self, int fd, unsigned int events)
+{
+    pyepoll_slot *slot;
+
+    if (fd >= self->nslots || PYEPOLL_REARMS(events))
+        return 0;
+    slot = &self->slots[fd];
+    return slot->registered && slot->kregistered && !slot->dirty &&
+        slot->events == events && slot->kevents == events &&
+        slot->kpriority == slot->priority;
+}
+
+/* The epoll fd registrations of a class go to; the class must exist. */
+static int
+pyepoll_class_epfd(pyEpoll_Object *self, int priority)
+{
+    return priority > 0 ? self->classfd[priority] : self->epfd;
+}
+
+/* Like pyepoll_class_epfd(), but create the epoll instance of the class
+   if it has none yet.  Returns -1 with an exception set on failure. */
+static int
+pyepoll_class_create(pyEpoll_Object *self, int priority)
+{
+    struct epoll_event ev;
+    int cfd, result;
+
+    if (priority < 0 || priority >= PYEPOLL_NCLASSES) {
+        PyErr_Format(PyExc_ValueError,
+                     "priority must be between 0 and %d, got %d",
+                     PYEPOLL_NCLASSES - 1, priority);
+        return -1;
+    }
+    if (priority == 0 || self->classfd[priority] >= 0)
+        return pyepoll_class_epfd(self, priority);
+
+    Py_BEGIN_ALLOW_THREADS
+    cfd = epoll_create(FD_SETSIZE-1);
+    result = -1;
+    if (cfd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = PYEPOLL_TAG(cfd, 0);
+        result = epoll_ctl(self->epfd, EPOLL_CTL_ADD, cfd, &ev);
+        if (result < 0) {
+            int save_errno = errno;
+            close(cfd);
+            errno = save_errno;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    if (result < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    self->classfd[priority] = cfd;
+    self->nclasses++;
+    return cfd;
+}
+
+/* True if fd is registered in a class other than priority.  The kernel
+   would take a register() in another class, the instances being
+   different, and both registrations would live on. */
+static int
+pyepoll_other_class(pyEpoll_Object *self, int fd, int priority)
+{
+    return fd < self->nslots && self->slots[fd].registered &&
+        self->slots[fd].priority != priority;
+}
+
+/* One epoll_ctl() of a batch: register_many() and friends, or a flush of
+   the deferred changes */
+typedef struct {
+    int fd;
+    int op;
+    int epfd;                           /* epoll fd of the fd's class */
+    int priority;                       /* class of an ADD */
+    unsigned int events;
+    PyObject *data;                     /* borrowed, or NULL */
+    unsigned int gen;                   /* tagged into epoll_data */
+    int err;                            /* errno of epoll_ctl(), or 0 */
+    int skip;                           /* no change, see pyepoll_unchanged */
+} pyepoll_op;
+
+/* Issue the ops without the GIL.  ADD of a registered fd and MOD of an
+   unknown one are retried the other way round, which covers a mirror
+   that is out of step with the kernel (a descriptor closed and reused,
+   say); DEL of a closed or unknown fd counts as done. */
+static void
+pyepoll_run_ops(pyepoll_op *ops, Py_ssize_t n)
+{
+    struct epoll_event ev;
+    Py_ssize_t i;
+    int epfd;
+
+    for (i = 0; i < n; i++) {
+        if (ops[i].skip)
+            continue;
+        ev.events = ops[i].events;
+        ev.data.u64 = PYEPOLL_TAG(ops[i].fd, ops[i].gen);
+        epfd = ops[i].epfd;
+        if (epoll_ctl(epfd, ops[i].op, ops[i].fd, &ev) == 0)
+            continue;
+        if (ops[i].op == EPOLL_CTL_DEL) {
+            if (errno != EBADF && errno != ENOENT)
+                ops[i].err = errno;
+            continue;
+        }
+        ops[i].err = errno;
+        if (ops[i].op == EPOLL_CTL_ADD && errno == EEXIST) {
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, ops[i].fd, &ev) == 0)
+                ops[i].err = 0;
+        }
+        else if (ops[i].op == EPOLL_CTL_MOD && errno == ENOENT) {
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, ops[i].fd, &ev) == 0)
+                ops[i].err = 0;
+        }
+    }
+}
+
+/* Put fd on the changes list unless it is there.  Returns -1 with
+   MemoryError set on failure. */
+static int
+pyepoll_queue(pyEpoll_Object *self, int fd)
+{
+    if (self->slots[fd].dirty)
+        return 0;
+    if (self->nchanges == self->changes_alloc) {
+        int alloc = self->changes_alloc ? 2 * self->changes_alloc : 64;
+        int *changes = self->changes;
+        PyMem_Resize(changes, int, alloc);
+        if (changes == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->changes = changes;
+        self->changes_alloc = alloc;
+    }
+    self->changes[self->nchanges++] = fd;
+    self->slots[fd].dirty = 1;
+    return 0;
+}
+
+/* Queue a change in deferred mode.  The mirror is checked and updated at
+   once, so register() of a registered fd and modify() or unregister() of
+   an unknown one fail right away.  Returns -1 with errno set on such a
+   failure, -2 with MemoryError set. */
+static int
+pyepoll_defer(pyEpoll_Object *self, int op, int fd, unsigned int events,
+              PyObject *data)
+{
+    int registered = fd < self->nslots && self->slots[fd].registered;
+
+    if (op == EPOLL_CTL_ADD && registered) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (op != EPOLL_CTL_ADD && !registered) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (pyepoll_queue(self, fd) < 0)
+        return -2;
+    if (op == EPOLL_CTL_MOD && PYEPOLL_REARMS(events))
+        self->slots[fd].rearm = 1;
+    pyepoll_applied(self, op, fd, events, data);
+    return 0;
+}
+
+/* Hand the queued changes to the kernel with one release of the GIL.
+   Returns a list of the (fd, errno) pairs that failed, or NULL with an
+   exception set.  A failed descriptor is dropped from the mirror. */
+static PyObject *
+pyepoll_flush_changes(pyEpoll_Object *self)
+{
+    PyObject *result, *failure;
+    pyepoll_op *ops;
+    pyepoll_slot *slot;
+    int i, n = 0, fd;
+
+    result = PyList_New(0);
+    if (result == NULL || self->nchanges == 0)
+        return result;
+    /* a change of class takes a DEL and an ADD */
+    ops = PyMem_New(pyepoll_op, 2 * self->nchanges);
+    if (ops == NULL) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < self->nchanges; i++) {
+        fd = self->changes[i];
+        slot = &self->slots[fd];
+        slot->dirty = 0;
+        if (slot->registered && slot->kregistered &&
+            slot->kpriority != slot->priority) {
+            ops[n].op = EPOLL_CTL_DEL;
+            ops[n].fd = fd;
+            ops[n].epfd = pyepoll_class_epfd(self, slot->kpriority);
+            ops[n].events = ops[n].gen = 0;
+            ops[n].err = ops[n].skip = 0;
+            slot->kregistered = 0;
+            n++;
+        }
+        if (slot->registered) {
+            if (slot->kregistered && slot->kevents == slot->events &&
+                !slot->rearm)
+                continue;
+            ops[n].op = slot->kregistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            ops[n].epfd = pyepoll_class_epfd(self, slot->priority);
+        }
+        else if (slot->kregistered) {
+            ops[n].op = EPOLL_CTL_DEL;
+            ops[n].epfd = pyepoll_class_epfd(self, slot->kpriority);
+        }
+        else {
+            continue;                   /* added and removed again */
+        }
+        ops[n].fd = fd;
+        ops[n].events = slot->events;
+        ops[n].gen = slot->gen;
+        ops[n].err = ops[n].skip = 0;
+        /* what the kernel will have; corrected below on failure */
+        slot->rearm = 0;
+        slot->kregistered = (ops[n].op != EPOLL_CTL_DEL);
+        slot->kevents = slot->events;
+        slot->kpriority = slot->priority;
+        pyepoll_arm(self, ops[n].op, fd, slot->events);
+        n++;
+    }
+    self->nchanges = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    pyepoll_run_ops(ops, n);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < n; i++) {
+        if (!ops[i].err)
+            continue;
+        /* close() may have freed the table while the GIL was released */
+        if (self->slots != NULL && ops[i].fd < self->nslots) {
+            slot = &self->slots[ops[i].fd];
+            slot->kregistered = 0;
+            slot->armed = 0;
+            if (!slot->dirty && slot->registered)
+                pyepoll_applied(self, EPOLL_CTL_DEL, ops[i].fd, 0, NULL);
+        }
+        failure = Py_BuildValue("ii", ops[i].fd, ops[i].err);
+        if (failure == NULL || PyList_Append(result, failure) < 0) {
+            Py_XDECREF(failure);
+            Py_CLEAR(result);
+            break;
+        }
+        Py_DECREF(failure);
+    }
+    PyMem_Free(ops);
+    return result;
+}
+
+/* Flush before a wait.  A failure raises IOError for the first failed
+   descriptor, with the fd as filename and all of them as failures. */
+static int
+pyepoll_flush_for_poll(pyEpoll_Object *self)
+{
+    PyObject *failures, *exc;
+    int fd, err;
+
+    if (self->nchanges == 0)
+        return 0;
+    failures = pyepoll_flush_changes(self);
+    if (failures == NULL)
+        return -1;
+    if (PyList_GET_SIZE(failures) == 0) {
+        Py_DECREF(failures);
+        return 0;
+    }
+    if (!PyArg_ParseTuple(PyList_GET_ITEM(failures, 0), "ii", &fd, &err)) {
+        Py_DECREF(failures);
+        return -1;
+    }
+    exc = PyObject_CallFunction(PyExc_IOError, "isi",
+                                err, strerror(err), fd);
+    if (exc != NULL) {
+        if (PyObject_SetAttrString(exc, "failures", failures) == 0)
+            PyErr_SetObject(PyExc_IOError, exc);
+        Py_DECREF(exc);
+    }
+    Py_DECREF(failures);
+    return -1;
+}
+
+static int
+pyepoll_tp_clear(pyEpoll_Object *self)
+{
+    int i;
+
+    for (i = 0; i < self->nslots; i++)
+        Py_CLEAR(self->slots[i].data);
+    return 0;
+}
+
+static int
+pyepoll_traverse(pyEpoll_Object *self, visitproc visit, void *arg)
+{
+    int i;
+
+    for (i = 0; i < self->nslots; i++)
+        Py_VISIT(self->slots[i].data);
+    return 0;
+}
+
+static int
+pyepoll_internal_close(pyEpoll_Object *self)
+{
+    int save_errno = 0, i;
+    if (self->slots != NULL) {
+        pyepoll_tp_clear(self);
+        PyMem_Free(self->slots);
+        self->slots = NULL;
+        self->nslots = 0;
+        self->nregistered = 0;
+    }
+    if (self->changes != NULL) {
+        PyMem_Free(self->changes);
+        self->changes = NULL;
+        self->nchanges = self->changes_alloc = 0;
+    }
+    if (self->ready != NULL) {
+        PyMem_Free(self->ready);
+        self->ready = NULL;
+        self->nready = self->ready_alloc = 0;
+    }
+    if (self->evs != NULL) {
+        PyMem_Free(self->evs);
+        self->evs = NULL;
+        self->nevs = 0;
+    }
+    for (i = 1; i < PYEPOLL_NCLASSES; i++) {
+        if (self->classfd[i] >= 0) {
+            close(self->classfd[i]);
+            self->classfd[i] = -1;
+        }
+    }
+    self->nclasses = 0;
+    if (self->wakefd >= 0) {
+        close(self->wakefd);
+        self->wakefd = -1;
+    }
+    if (self->epfd >= 0) {
+        int epfd = self->epfd;
+        self->epfd = -1;
+        Py_BEGIN_ALLOW_THREADS
+        if (close(epfd) < 0)
+            save_errno = errno;
+        Py_END_ALLOW_THREADS
+    }
+    return save_errno;
+}
+
+static PyObject *
+newPyEpoll_Object(PyTypeObject *type, int sizehint, SOCKET fd, int adaptive,
+                  int deferred, int sticky)
+{
+    pyEpoll_Object *self;
+    int i;
+
+    if (sizehint == -1) {
+        sizehint = FD_SETSIZE-1;
+    }
+    else if (sizehint < 1) {
+        PyErr_Format(PyExc_ValueError,
+                     "sizehint must be greater zero, got %d",
+                     sizehint);
+        return NULL;
+    }
+
+    assert(type != NULL && type->tp_alloc != NULL);
+    self = (pyEpoll_Object *) type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    for (i = 0; i < PYEPOLL_NCLASSES; i++) {
+        self->classfd[i] = -1;
+        self->budget[i] = -1;
+    }
+    self->wakefd = -1;
+
+    if (fd == -1) {
+        Py_BEGIN_ALLOW_THREADS
+        self->epfd = epoll_create(sizehint);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        self->epfd = fd;
+    }
+    if (self->epfd < 0) {
+        Py_DECREF(self);
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    self->adaptive = adaptive;
+    self->batch = PYEPOLL_BATCH_INITIAL;
+    self->deferred = deferred;
+    self->sticky = sticky;
+    return (PyObject *)self;
+}
+
+
+static PyObject *
+pyepoll_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    int sizehint = -1, adaptive = 0, deferred = 0, sticky = 0;
+    static char *kwlist[] = {"sizehint", "adaptive", "deferred", "sticky",
+                             NULL};
+
+    /* the modes are keyword only */
+    if (PyTuple_GET_SIZE(args) > 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "epoll() takes at most 1 positional argument "
+                     "(%d given)", (int)PyTuple_GET_SIZE(args));
+        return NULL;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiii:epoll", kwlist,
+                                     &sizehint, &adaptive, &deferred,
+                                     &sticky))
+        return NULL;
+
+    return newPyEpoll_Object(type, sizehint, -1, adaptive, deferred,
+                             sticky);
+}
+
+
+static void
+pyepoll_dealloc(pyEpoll_Object *self)
+{
+    PyObject_GC_UnTrack(self);
+    (void)pyepoll_internal_close(self);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject*
+pyepoll_close(pyEpoll_Object *self)
+{
+    errno = pyepoll_internal_close(self);
+    if (errno < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pyepoll_close_doc,
+"close() -> None\n\
+\n\
+Close the epoll control file descriptor. Further operations on the epoll\n\
+object will raise an exception.");
+
+static PyObject*
+pyepoll_get_closed(pyEpoll_Object *self)
+{
+    if (self->epfd < 0)
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject*
+pyepoll_fileno(pyEpoll_Object *self)
+{
+    if (self->epfd < 0)
+        return pyepoll_err_closed();
+    return PyInt_FromLong(self->epfd);
+}
+
+PyDoc_STRVAR(pyepoll_fileno_doc,
+"fileno() -> int\n\
+\n\
+Return the epoll control file descriptor.");
+
+static PyObject*
+pyepoll_fromfd(PyObject *cls, PyObject *args)
+{
+    SOCKET fd;
+
+    if (!PyArg_ParseTuple(args, "i:fromfd", &fd))
+        return NULL;
+
+    return newPyEpoll_Object((PyTypeObject*)cls, -1, fd, 0, 0, 0);
+}
+
+PyDoc_STRVAR(pyepoll_fromfd_doc,
+"fromfd(fd) -> epoll\n\
+\n\
+Create an epoll object from a given control fd.");
+
+static PyObject *
+pyepoll_internal_ctl(pyEpoll_Object *self, int op, PyObject *pfd,
+                     unsigned int events, PyObject *data, int priority)
+{
+    struct epoll_event ev;
+    int result;
+    int fd, epfd = self->epfd;
+
+    if (epfd < 0)
+        return pyepoll_err_closed();
+
+    fd = PyObject_AsFileDescriptor(pfd);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (op != EPOLL_CTL_DEL && pyepoll_reserve(self, fd) < 0)
+        return NULL;
+    if (self->sticky && op != EPOLL_CTL_DEL)
+        events |= EPOLLET;
+    if (op == EPOLL_CTL_ADD && pyepoll_other_class(self, fd, priority)) {
+        errno = EEXIST;
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    if (op == EPOLL_CTL_ADD)
+        epfd = pyepoll_class_create(self, priority);
+    else if (fd < self->nslots && self->slots[fd].kregistered)
+        epfd = pyepoll_class_epfd(self, self->slots[fd].kpriority);
+    if (epfd < 0)
+        return NULL;
+    if (self->deferred) {
+        result = pyepoll_defer(self, op, fd, events, data);
+        if (result == -1)
+            PyErr_SetFromErrno(PyExc_IOError);
+        if (result < 0)
+            return NULL;
+        if (op == EPOLL_CTL_ADD)
+            self->slots[fd].priority = priority;
+        Py_RETURN_NONE;
+    }
+    if (op == EPOLL_CTL_MOD && pyepoll_unchanged(self, fd, events)) {
+        pyepoll_applied(self, op, fd, events, data);
+        Py_RETURN_NONE;
+    }
+
+    switch(op) {
+        case EPOLL_CTL_ADD:
+        case EPOLL_CTL_MOD:
+        ev.events = events;
+        ev.data.u64 = PYEPOLL_TAG(fd, pyepoll_next_gen(self, op, fd));
+        pyepoll_arm(self, op, fd, events);
+        Py_BEGIN_ALLOW_THREADS
+        result = epoll_ctl(epfd, op, fd, &ev);
+        Py_END_ALLOW_THREADS
+        break;
+        case EPOLL_CTL_DEL:
+        /* In kernel versions before 2.6.9, the EPOLL_CTL_DEL
+         * operation required a non-NULL pointer in event, even
+         * though this argument is ignored. */
+        Py_BEGIN_ALLOW_THREADS
+        result = epoll_ctl(epfd, op, fd, &ev);
+        if (result < 0 && errno == EBADF) {
+            /* fd already closed */
+            result = 0;
+            errno = 0;
+        }
+        Py_END_ALLOW_THREADS
+        break;
+        default:
+        result = -1;
+        errno = EINVAL;
+    }
+
+    if (result < 0) {
+        if (op != EPOLL_CTL_DEL)
+            self->slots[fd].armed = 0;
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    if (op == EPOLL_CTL_ADD)
+        self->slots[fd].priority = priority;
+    pyepoll_applied(self, op, fd, events, data);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+pyepoll_register(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
 {
-    pollObject *self;
-    self = PyObject_New(pollObject, &poll_Type);
-    if (self == NULL)
+    PyObject *pfd, *data = NULL;
+    unsigned int events = EPOLLIN | EPOLLOUT | EPOLLPRI;
+    int priority = 0;
+    static char *kwlist[] = {"fd", "eventmask", "data", "priority", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|IOi:register", kwlist,
+                                     &pfd, &events, &data, &priority)) {
         return NULL;
-    /* ufd_uptodate is a Boolean, denoting whether the
-       array pointed to by ufds matches the contents of the dictionary. */
-    self->ufd_uptodate = 0;
-    self->ufds = NULL;
-    self->dict = PyDict_New();
-    if (self->dict == NULL) {
-        Py_DECREF(self);
+    }
+
+    return pyepoll_internal_ctl(self, EPOLL_CTL_ADD, pfd, events, data,
+                                priority);
+}
+
+PyDoc_STRVAR(pyepoll_register_doc,
+"register(fd[, eventmask[, data[, priority]]]) -> bool\n\
+\n\
+Registers a new fd or modifies an already registered fd. register() returns\n\
+True if a new fd was registered or False if the event mask for fd was modified.\n\
+fd is the target file descriptor of the operation.\n\
+events is a bit set composed of the various EPOLL constants; the default\n\
+is EPOLL_IN | EPOLL_OUT | EPOLL_PRI.\n\
+data is an optional object, an int token or a connection say, that poll()\n\
+returns in place of fd. It is kept alive until fd is unregistered.\n\
+priority is the class of fd, 0 (the default) to 3: poll() returns the\n\
+events of higher classes first, see set_budget(). modify() keeps the\n\
+class; unregister and register fd again to change it. register() of an\n\
+fd registered in another class raises IOError(EEXIST).\n\
+\n\
+The epoll interface supports all file descriptors that support poll.");
+
+static PyObject *
+pyepoll_modify(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *pfd, *data = NULL;
+    unsigned int events;
+    static char *kwlist[] = {"fd", "eventmask", "data", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OI|O:modify", kwlist,
+                                     &pfd, &events, &data)) {
+        return NULL;
+    }
+
+    return pyepoll_internal_ctl(self, EPOLL_CTL_MOD, pfd, events, data, 0);
+}
+
+PyDoc_STRVAR(pyepoll_modify_doc,
+"modify(fd, eventmask[, data]) -> None\n\
+\n\
+fd is the target file descriptor of the operation\n\
+events is a bit set composed of the various EPOLL constants\n\
+data replaces the object poll() returns for fd; it is kept if omitted");
+
+static PyObject *
+pyepoll_unregister(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *pfd;
+    static char *kwlist[] = {"fd", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:unregister", kwlist,
+                                     &pfd)) {
+        return NULL;
+    }
+
+    return pyepoll_internal_ctl(self, EPOLL_CTL_DEL, pfd, 0, NULL, 0);
+}
+
+static PyObject *
+pyepoll_forget(pyEpoll_Object *self, PyObject *pfd)
+{
+    pyepoll_slot *slot;
+    int fd;
+
+    if (self->epfd < 0)
+        return pyepoll_err_closed();
+    fd = PyObject_AsFileDescriptor(pfd);
+    if (fd == -1)
+        return NULL;
+    if (pyepoll_reserve(self, fd) < 0)
+        return NULL;
+
+    /* no epoll_ctl(): the kernel dropped fd when its file was closed, or
+       what it still reports is of the old generation */
+    slot = &self->slots[fd];
+    slot->gen = pyepoll_next_gen(self, EPOLL_CTL_ADD, fd);
+    pyepoll_applied(self, EPOLL_CTL_DEL, fd, 0, NULL);
+    slot->kregistered = 0;
+    slot->rearm = 0;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pyepoll_forget_doc,
+"forget(fd) -> None\n\
+\n\
+Drop fd from the object without a system call, for a descriptor that is\n\
+closed instead of unregistered. poll() no longer reports events of the\n\
+old registration, even if the descriptor number is reused before the\n\
+kernel stops reporting them; the data object is released. Pass the fd\n\
+as an int if the file object is already closed. Unknown fds are\n\
+ignored.");
+
+static PyObject *
+pyepoll_done(pyEpoll_Object *self, PyObject *pfd)
+{
+    pyepoll_slot *slot;
+    int fd;
+
+    if (self->epfd < 0)
+        return pyepoll_err_closed();
+    fd = PyObject_AsFileDescriptor(pfd);
+    if (fd == -1)
+        return NULL;
+    if (fd >= self->nslots || !self->slots[fd].registered) {
+        PyObject *key = PyInt_FromLong(fd);
+        if (key != NULL) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            Py_DECREF(key);
+        }
+        return NULL;
+    }
+    slot = &self->slots[fd];
+#ifdef EPOLLONESHOT
+    if (!(slot->events & EPOLLONESHOT))
+#endif
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "fd isn't registered with EPOLLONESHOT");
+        return NULL;
+    }
+    if (slot->armed || slot->rearm)
+        Py_RETURN_FALSE;
+    if (pyepoll_queue(self, fd) < 0)
+        return NULL;
+    slot->rearm = 1;
+    Py_RETURN_TRUE;
+}
+
+PyDoc_STRVAR(pyepoll_done_doc,
+"done(fd) -> bool\n\
+\n\
+Rearm fd, registered with EPOLLONESHOT, at the start of the next poll()\n\
+or flush(), batched with the other fds done by then. Returns False,\n\
+doing nothing, if fd is armed or its rearm is already queued: poll()\n\
+disarms an fd when it returns its event. Raises KeyError if fd isn't\n\
+registered.");
+
+static PyObject *
+pyepoll_mark_drained(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *pfd;
+    unsigned int events = ~0U;
+    int fd;
+    static char *kwlist[] = {"fd", "eventmask", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|I:mark_drained", kwlist,
+                                     &pfd, &events)) {
+        return NULL;
+    }
+    fd = PyObject_AsFileDescriptor(pfd);
+    if (fd == -1)
+        return NULL;
+    pyepoll_clear_ready(self, fd, events);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pyepoll_mark_drained_doc,
+"mark_drained(fd[, eventmask]) -> None\n\
+\n\
+Tell an epoll object in sticky mode that fd returned EAGAIN, so poll()\n\
+stops reporting the events of eventmask (all of them by default) until\n\
+the kernel signals fd again.");
+
+static PyObject *
+pyepoll_set_budget(pyEpoll_Object *self, PyObject *args)
+{
+    int priority, budget, old;
+
+    if (!PyArg_ParseTuple(args, "ii:set_budget", &priority, &budget))
+        return NULL;
+    if (priority < 0 || priority >= PYEPOLL_NCLASSES) {
+        PyErr_Format(PyExc_ValueError,
+                     "priority must be between 0 and %d, got %d",
+                     PYEPOLL_NCLASSES - 1, priority);
+        return NULL;
+    }
+    if (budget < 1 && budget != -1) {
+        PyErr_Format(PyExc_ValueError,
+                     "budget must be greater than 0 or -1, got %d",
+                     budget);
+        return NULL;
+    }
+    old = self->budget[priority];
+    self->budget[priority] = budget;
+    return PyInt_FromLong(old);
+}
+
+PyDoc_STRVAR(pyepoll_set_budget_doc,
+"set_budget(priority, budget) -> int\n\
+\n\
+Limit the events a poll() returns for the fds of a priority class to\n\
+budget, or lift the limit with -1 (the default), and return the previous\n\
+budget. The classes are served from the highest down, so a budget keeps\n\
+a busy class from filling the batch of a poll() on its own; the events\n\
+it leaves are returned by the next calls.");
+
+static PyObject *
+pyepoll_set_spin(pyEpoll_Object *self, PyObject *args)
+{
+    long usecs, old;
+
+    if (!PyArg_ParseTuple(args, "l:set_spin", &usecs))
+        return NULL;
+    if (usecs < 0 || usecs > 1000000L) {
+        PyErr_Format(PyExc_ValueError,
+                     "spin must be between 0 and 1000000 us, got %ld",
+                     usecs);
+        return NULL;
+    }
+    old = self->spin / 1000;
+    self->spin = usecs * 1000;
+    return PyInt_FromLong(old);
+}
+
+PyDoc_STRVAR(pyepoll_set_spin_doc,
+"set_spin(usecs) -> int\n\
+\n\
+Make poll(), poll_into() and run() check for events without waiting, for\n\
+up to usecs microseconds and with the GIL held, before they block; 0\n\
+(the default) turns it off. Returns the previous value. Events that come\n\
+while spinning skip the scheduler's wakeup, at the cost of a busy CPU;\n\
+the spin_hits and spin_misses attributes count the spins that found\n\
+events and those that didn't.");
+
+static PyObject *
+pyepoll_set_busy_poll(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
+{
+    struct epoll_params params;
+    unsigned int usecs, budget = 64;
+    int prefer = 0, result;
+    static char *kwlist[] = {"usecs", "budget", "prefer", NULL};
+
+    if (self->epfd < 0)
+        return pyepoll_err_closed();
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "I|Ii:set_busy_poll",
+                                     kwlist, &usecs, &budget, &prefer)) {
+        return NULL;
+    }
+    if (budget > 0xffff) {
+        PyErr_Format(PyExc_ValueError,
+                     "budget must be less than 65536, got %u", budget);
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = usecs;
+    params.busy_poll_budget = (uint16_t)budget;
+    params.prefer_busy_poll = prefer ? 1 : 0;
+    result = ioctl(self->epfd, EPIOCSPARAMS, &params);
+    if (result < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pyepoll_set_busy_poll_doc,
+"set_busy_poll(usecs[, budget=64[, prefer=False]]) -> None\n\
+\n\
+Set the busy polling parameters of the epoll instance (EPIOCSPARAMS,\n\
+Linux 6.9): the kernel polls the network devices of the registered\n\
+sockets for up to usecs microseconds, budget packets at a time, before\n\
+it sleeps. Raises IOError (ENOTTY) if the kernel lacks them; a budget\n\
+above 64 needs CAP_NET_ADMIN.");
+
+static PyObject *
+pyepoll_get_busy_poll(pyEpoll_Object *self)
+{
+    struct epoll_params params;
+
+    if (self->epfd < 0)
+        return pyepoll_err_closed();
+    memset(&params, 0, sizeof(params));
+    if (ioctl(self->epfd, EPIOCGPARAMS, &params) < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    return Py_BuildValue("IIO", params.busy_poll_usecs,
+                         (unsigned int)params.busy_poll_budget,
+                         params.prefer_busy_poll ? Py_True : Py_False);
+}
+
+PyDoc_STRVAR(pyepoll_get_busy_poll_doc,
+"get_busy_poll() -> (usecs, budget, prefer)\n\
+\n\
+Return the busy polling parameters of the epoll instance, see\n\
+set_busy_poll().");
+
+static PyObject *
+pyepoll_flush(pyEpoll_Object *self)
+{
+    if (self->epfd < 0)
+        return pyepoll_err_closed();
+    return pyepoll_flush_changes(self);
+}
+
+PyDoc_STRVAR(pyepoll_flush_doc,
+"flush() -> [(fd, errno), ...]\n\
+\n\
+Hand the changes queued in deferred mode, and the rearms queued by done(),\n\
+to the kernel now instead of at the next poll(). The descriptors that\n\
+failed are returned with their errno and are no longer registered.");
+
+static PyObject *
+pyepoll_get_mask(pyEpoll_Object *self, PyObject *pfd)
+{
+    int fd;
+
+    fd = PyObject_AsFileDescriptor(pfd);
+    if (fd == -1)
+        return NULL;
+    if (fd >= self->nslots || !self->slots[fd].registered) {
+        PyObject *key = PyInt_FromLong(fd);
+        if (key != NULL) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            Py_DECREF(key);
+        }
+        return NULL;
+    }
+    return PyLong_FromUnsignedLong(self->slots[fd].events);
+}
+
+PyDoc_STRVAR(pyepoll_get_mask_doc,
+"get_mask(fd) -> int\n\
+\n\
+Return the event mask fd is registered with. Raises KeyError if fd\n\
+isn't registered with this epoll object.");
+
+static Py_ssize_t
+pyepoll_length(pyEpoll_Object *self)
+{
+    return self->nregistered;
+}
+
+static int
+pyepoll_contains(pyEpoll_Object *self, PyObject *pfd)
+{
+    int fd;
+
+    fd = PyObject_AsFileDescriptor(pfd);
+    if (fd == -1)
+        return -1;
+    return fd < self->nslots && self->slots[fd].registered;
+}
+
+/* Iterate over a snapshot of the registered descriptors, in order. */
+static PyObject *
+pyepoll_iter(pyEpoll_Object *self)
+{
+    PyObject *list, *fd, *it;
+    int i, n = 0;
+
+    list = PyList_New(self->nregistered);
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < self->nslots && n < self->nregistered; i++) {
+        if (!self->slots[i].registered)
+            continue;
+        fd = PyInt_FromLong(i);
+        if (fd == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, n++, fd);
+    }
+    it = PyObject_GetIter(list);
+    Py_DECREF(list);
+    return it;
+}
+
+PyDoc_STRVAR(pyepoll_unregister_doc,
+"unregister(fd) -> None\n\
+\n\
+fd is the target file descriptor of the operation.");
+
+/* Apply op to every entry of seq with a single release of the GIL.
+   The entries are all parsed first; a malformed one raises before any
+   change is made.  Failures of epoll_ctl() don't stop the batch: they
+   are returned as a list of (fd, errno) pairs. */
+static PyObject *
+pyepoll_internal_ctl_many(pyEpoll_Object *self, int op, PyObject *seq,
+                          const char *fname)
+{
+    PyObject *fast_seq, *item, *pfd, *result = NULL, *failure;
+    pyepoll_op *ops;
+    struct epoll_event ev;
+    Py_ssize_t i, n;
+    int epfd = self->epfd, deferred, mirror;
+    char format[32];
+
+    if (epfd < 0)
+        return pyepoll_err_closed();
+
+    /* a tuple, so that fileno() methods can't pull the entries and the
+       borrowed data objects out from under us */
+    fast_seq = PySequence_Tuple(seq);
+    if (fast_seq == NULL)
         return NULL;
+    n = PyTuple_GET_SIZE(fast_seq);
+    ops = PyMem_New(pyepoll_op, n ? n : 1);
+    if (ops == NULL) {
+        Py_DECREF(fast_seq);
+        return PyErr_NoMemory();
+    }
+    PyOS_snprintf(format, sizeof(format), "OI|O%s:%s",
+                  op == EPOLL_CTL_ADD ? "i" : "", fname);
+
+    for (i = 0; i < n; i++) {
+        item = PyTuple_GET_ITEM(fast_seq, i);
+        ops[i].op = op;
+        ops[i].events = 0;
+        ops[i].data = NULL;
+        ops[i].priority = 0;
+        ops[i].gen = 0;
+        ops[i].err = 0;
+        if (op == EPOLL_CTL_DEL) {
+            pfd = item;
+        }
+        else if (!PyTuple_Check(item)) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() entries must be (fd, eventmask[, data]) "
+                         "tuples", fname);
+            goto finally;
+        }
+        else if (!PyArg_ParseTuple(item, format, &pfd, &ops[i].events,
+                                   &ops[i].data, &ops[i].priority)) {
+            goto finally;
+        }
+        if (self->sticky && op != EPOLL_CTL_DEL)
+            ops[i].events |= EPOLLET;
+        ops[i].fd = PyObject_AsFileDescriptor(pfd);
+        if (ops[i].fd == -1)
+            goto finally;
+        if (op != EPOLL_CTL_DEL) {
+            if (pyepoll_reserve(self, ops[i].fd) < 0)
+                goto finally;
+            ops[i].gen = pyepoll_next_gen(self, op, ops[i].fd);
+        }
+        if (op == EPOLL_CTL_ADD)
+            ops[i].epfd = pyepoll_class_create(self, ops[i].priority);
+        else if (ops[i].fd < self->nslots &&
+                 self->slots[ops[i].fd].kregistered)
+            ops[i].epfd = pyepoll_class_epfd(self,
+                                             self->slots[ops[i].fd].kpriority);
+        else
+            ops[i].epfd = epfd;
+        if (ops[i].epfd < 0)
+            goto finally;
+        ops[i].skip = (op == EPOLL_CTL_MOD &&
+                       pyepoll_unchanged(self, ops[i].fd, ops[i].events));
+        if (op == EPOLL_CTL_ADD &&
+            pyepoll_other_class(self, ops[i].fd, ops[i].priority)) {
+            ops[i].err = EEXIST;
+            ops[i].skip = 1;
+        }
+    }
+
+    deferred = self->deferred;
+    if (deferred) {
+        /* queue them; only mistakes the mirror can tell fail now */
+        for (i = 0; i < n; i++) {
+            int r = pyepoll_defer(self, op, ops[i].fd, ops[i].events,
+                                  ops[i].data);
+            if (r == -2)
+                goto finally;
+            if (r == -1)
+                ops[i].err = errno;
+            else if (op == EPOLL_CTL_ADD)
+                self->slots[ops[i].fd].priority = ops[i].priority;
+        }
+    }
+    else {
+        for (i = 0; i < n; i++) {
+            if (!ops[i].skip && op != EPOLL_CTL_DEL)
+                pyepoll_arm(self, op, ops[i].fd, ops[i].events);
+        }
+        Py_BEGIN_ALLOW_THREADS
+        for (i = 0; i < n; i++) {
+            if (ops[i].skip)
+                continue;
+            ev.events = ops[i].events;
+            ev.data.u64 = PYEPOLL_TAG(ops[i].fd, ops[i].gen);
+            if (epoll_ctl(ops[i].epfd, op, ops[i].fd, &ev) < 0) {
+                /* fd already closed */
+                if (op != EPOLL_CTL_DEL || errno != EBADF)
+                    ops[i].err = errno;
+            }
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    result = PyList_New(0);
+    if (result == NULL)
+        goto finally;
+    /* close() may have freed the table while the GIL was released */
+    mirror = !deferred && self->slots != NULL;
+    for (i = 0; i < n; i++) {
+        if (ops[i].err) {
+            if (mirror && op != EPOLL_CTL_DEL && !ops[i].skip)
+                self->slots[ops[i].fd].armed = 0;
+            failure = Py_BuildValue("ii", ops[i].fd, ops[i].err);
+            if (failure == NULL || PyList_Append(result, failure) < 0) {
+                Py_XDECREF(failure);
+                Py_CLEAR(result);
+                goto finally;
+            }
+            Py_DECREF(failure);
+        }
+        else if (mirror) {
+            if (op == EPOLL_CTL_ADD)
+                self->slots[ops[i].fd].priority = ops[i].priority;
+            pyepoll_applied(self, op, ops[i].fd, ops[i].events,
+                            ops[i].data);
+        }
     }
-    return self;
+
+  finally:
+    PyMem_Free(ops);
+    Py_DECREF(fast_seq);
+    return result;
 }
 
-static void
-poll_dealloc(pollObject *self)
+static PyObject *
+pyepoll_register_many(pyEpoll_Object *self, PyObject *seq)
 {
-    if (self->ufds != NULL)
-        PyMem_DEL(self->ufds);
-    Py_XDECREF(self->dict);
-    PyObject_Del(self);
+    return pyepoll_internal_ctl_many(self, EPOLL_CTL_ADD, seq,
+                                     "register_many");
 }
 
+PyDoc_STRVAR(pyepoll_register_many_doc,
+"register_many(entries) -> [(fd, errno), ...]\n\
+\n\
+Register every (fd, eventmask[, data[, priority]]) tuple of entries, as\n\
+register() would, with a single release of the GIL. An entry that fails\n\
+doesn't stop the others; the failures are returned as (fd, errno) pairs.");
+
 static PyObject *
-poll_getattr(pollObject *self, char *name)
+pyepoll_modify_many(pyEpoll_Object *self, PyObject *seq)
 {
-    return Py_FindMethod(poll_methods, (PyObject *)self, name);
+    return pyepoll_internal_ctl_many(self, EPOLL_CTL_MOD, seq,
+                                     "modify_many");
 }
 
-static PyTypeObject poll_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "select_backport.poll",              /*tp_name*/
-    sizeof(pollObject),         /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    /* methods */
-    (destructor)poll_dealloc, /*tp_dealloc*/
-    0,                          /*tp_print*/
-    (getattrfunc)poll_getattr, /*tp_getattr*/
-    0,                      /*tp_setattr*/
-    0,                          /*tp_compare*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    0,                          /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash*/
-};
-
-PyDoc_STRVAR(poll_doc,
-"Returns a polling object, which supports registering and\n\
-unregistering file descriptors, and then polling them for I/O events.");
+PyDoc_STRVAR(pyepoll_modify_many_doc,
+"modify_many(entries) -> [(fd, errno), ...]\n\
+\n\
+Like register_many(), but modify registered descriptors.");
 
 static PyObject *
-select_poll(PyObject *self, PyObject *unused)
+pyepoll_unregister_many(pyEpoll_Object *self, PyObject *seq)
 {
-    return (PyObject *)newPollObject();
+    return pyepoll_internal_ctl_many(self, EPOLL_CTL_DEL, seq,
+                                     "unregister_many");
 }
 
-#ifdef __APPLE__
-/*
- * On some systems poll() sets errno on invalid file descriptors. We test
- * for this at runtime because this bug may be fixed or introduced between
- * OS releases.
- */
-static int select_have_broken_poll(void)
+PyDoc_STRVAR(pyepoll_unregister_many_doc,
+"unregister_many(fds) -> [(fd, errno), ...]\n\
+\n\
+Unregister every descriptor of fds with a single release of the GIL and\n\
+return the failures as (fd, errno) pairs.");
+
+/* The wait of poll(), poll_into() and run(): flush the deferred changes,
+   wait for up to maxevents events and sort out the stale and the sticky
+   ones.  Returns the number of events in *evs, which the caller hands
+   back with pyepoll_put_events(self, *evs, *nevs), or -1 with an
+   exception set: -2 if that is the IOError(EINTR) of a signal whose
+   handlers didn't raise. */
+static int
+pyepoll_fetch(pyEpoll_Object *self, int maxevents, int batched,
+              struct timespec *tsp, struct epoll_event **evs, int *nevs)
 {
-    int poll_test;
-    int filedes[2];
-
-    struct pollfd poll_struct = { 0, POLLIN|POLLPRI|POLLOUT, 0 };
+    struct timespec zero, remaining, deadline;
+    int nfds = 0, spun = 0, nraw, woken = 0, err, interrupted = 0;
 
-    /* Create a file descriptor to make invalid */
-    if (pipe(filedes) < 0) {
-        return 1;
+    if (pyepoll_flush_for_poll(self) < 0)
+        return -1;
+    if (self->sticky && self->nready) {
+        /* there is something to report already */
+        zero.tv_sec = zero.tv_nsec = 0;
+        tsp = &zero;
     }
-    poll_struct.fd = filedes[0];
-    close(filedes[0]);
-    close(filedes[1]);
-    poll_test = poll(&poll_struct, 1, 0);
-    if (poll_test < 0) {
-        return 1;
-    } else if (poll_test == 0 && poll_struct.revents != POLLNVAL) {
-        return 1;
+    if (tsp != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += tsp->tv_sec;
+        deadline.tv_nsec += tsp->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            deadline.tv_sec++;
+        }
     }
-    return 0;
-}
-#endif /* __APPLE__ */
-
-#endif /* HAVE_POLL */
-
-#ifdef HAVE_EPOLL
-/* **************************************************************************
- *                      epoll interface for Linux 2.6
- *
- * Written by Christian Heimes
- * Inspired by Twisted's _epoll.pyx and select.poll()
- */
-
-#ifdef HAVE_SYS_EPOLL_H
-#include <sys/epoll.h>
-#endif
+    if (self->nclasses && maxevents > INT_MAX / 2)
+        maxevents = INT_MAX / 2;
+    *evs = pyepoll_get_events(self, pyepoll_events_needed(self, maxevents),
+                              nevs);
+    if (*evs == NULL)
+        return -1;
 
-typedef struct {
-    PyObject_HEAD
-    SOCKET epfd;                        /* epoll control file descriptor */
-} pyEpoll_Object;
+    if (self->spin > 0 && (tsp == NULL || tsp->tv_sec || tsp->tv_nsec)) {
+        long ns = self->spin;
+        spun = 1;
+        if (tsp != NULL && tsp->tv_sec == 0 && tsp->tv_nsec < ns)
+            ns = tsp->tv_nsec;
+        nfds = pyepoll_spin(self, *evs, maxevents, ns);
+        if (nfds > 0)
+            self->spin_hits++;
+        else if (nfds == 0) {
+            self->spin_misses++;
+            if (tsp != NULL) {
+                /* wait for what is left of the timeout */
+                remaining = *tsp;
+                remaining.tv_nsec -= ns;
+                if (remaining.tv_nsec < 0) {
+                    remaining.tv_nsec += 1000000000L;
+                    remaining.tv_sec--;
+                }
+                tsp = &remaining;
+            }
+        }
+    }
+    for (;;) {
+        if (!spun ||
+            (nfds == 0 && (tsp == NULL || tsp->tv_sec || tsp->tv_nsec)))
+            nfds = pyepoll_wait(self, *evs, maxevents, tsp);
+        err = errno;
+        pyepoll_account(self, nfds, maxevents, batched);
+        if (nfds < 0) {
+            /* run the handlers first, so that the errno is still ours */
+            if (err == EINTR && PyErr_CheckSignals() < 0)
+                goto error;
+            errno = err;
+            PyErr_SetFromErrno(PyExc_IOError);
+            interrupted = err == EINTR;
+            goto error;
+        }
+        nfds = pyepoll_unwake(self, *evs, nfds, &woken);
+        nraw = nfds;
+        nfds = pyepoll_live(self, *evs, nfds);
+        if (nfds == nraw)
+            break;
+        /* if all there was were leftovers of old generations, wait for
+           the rest of the timeout */
+        if (nfds > 0 || woken ||
+            (tsp != NULL && !tsp->tv_sec && !tsp->tv_nsec))
+            break;
+        spun = 0;
+        if (tsp != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &remaining);
+            remaining.tv_sec = deadline.tv_sec - remaining.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - remaining.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                remaining.tv_nsec += 1000000000L;
+                remaining.tv_sec--;
+            }
+            if (remaining.tv_sec < 0)
+                remaining.tv_sec = remaining.tv_nsec = 0;
+            tsp = &remaining;
+        }
+    }
+    if (self->sticky) {
+        nfds = pyepoll_collect(self, *evs, nfds, maxevents);
+        if (nfds < 0)
+            goto error;
+    }
+    return nfds;
 
-static PyTypeObject pyEpoll_Type;
-#define pyepoll_CHECK(op) (PyObject_TypeCheck((op), &pyEpoll_Type))
+  error:
+    pyepoll_put_events(self, *evs, *nevs);
+    return interrupted ? -2 : -1;
+}
 
 static PyObject *
-pyepoll_err_closed(void)
+pyepoll_poll(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
 {
-    PyErr_SetString(PyExc_ValueError, "I/O operation on closed epoll fd");
-    return NULL;
-}
+    double dtimeout = -1.;
+    struct timespec ts, *tsp = NULL;
+    int maxevents = -1, batched = 0;
+    int nfds, nevs, i, fd;
+    PyObject *elist = NULL, *etuple = NULL, *data;
+    struct epoll_event *evs = NULL;
+    static char *kwlist[] = {"timeout", "maxevents", NULL};
 
-static int
-pyepoll_internal_close(pyEpoll_Object *self)
-{
-    int save_errno = 0;
-    if (self->epfd >= 0) {
-        int epfd = self->epfd;
-        self->epfd = -1;
-        Py_BEGIN_ALLOW_THREADS
-        if (close(epfd) < 0)
-            save_errno = errno;
-        Py_END_ALLOW_THREADS
+    if (self->epfd < 0)
+        return pyepoll_err_closed();
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|di:poll", kwlist,
+                                     &dtimeout, &maxevents)) {
+        return NULL;
     }
-    return save_errno;
-}
 
-static PyObject *
-newPyEpoll_Object(PyTypeObject *type, int sizehint, SOCKET fd)
-{
-    pyEpoll_Object *self;
+    if (dtimeout >= 0) {
+        if (select_timespec_d(dtimeout, &ts) < 0)
+            return NULL;
+        tsp = &ts;
+    }
 
-    if (sizehint == -1) {
-        sizehint = FD_SETSIZE-1;
+    if (maxevents == -1) {
+        if (self->adaptive) {
+            maxevents = self->batch;
+            batched = 1;
+        }
+        else
+            maxevents = FD_SETSIZE-1;
     }
-    else if (sizehint < 1) {
+    else if (maxevents < 1) {
         PyErr_Format(PyExc_ValueError,
-                     "sizehint must be greater zero, got %d",
-                     sizehint);
+                     "maxevents must be greater than 0, got %d",
+                     maxevents);
         return NULL;
     }
 
-    assert(type != NULL && type->tp_alloc != NULL);
-    self = (pyEpoll_Object *) type->tp_alloc(type, 0);
-    if (self == NULL)
+    nfds = pyepoll_fetch(self, maxevents, batched, tsp, &evs, &nevs);
+    if (nfds < 0)
         return NULL;
 
-    if (fd == -1) {
-        Py_BEGIN_ALLOW_THREADS
-        self->epfd = epoll_create(sizehint);
-        Py_END_ALLOW_THREADS
-    }
-    else {
-        self->epfd = fd;
+    elist = PyList_New(nfds);
+    if (elist == NULL) {
+        goto error;
     }
-    if (self->epfd < 0) {
-        Py_DECREF(self);
-        PyErr_SetFromErrno(PyExc_IOError);
-        return NULL;
+
+    for (i = 0; i < nfds; i++) {
+        fd = PYEPOLL_TAG_FD(evs[i].data.u64);
+        data = pyepoll_get_data(self, fd);
+        if (data != NULL)
+            etuple = Py_BuildValue("OI", data, evs[i].events);
+        else
+            etuple = Py_BuildValue("iI", fd, evs[i].events);
+        if (etuple == NULL) {
+            Py_CLEAR(elist);
+            goto error;
+        }
+        PyList_SET_ITEM(elist, i, etuple);
     }
-    return (PyObject *)self;
-}
 
+    error:
+    pyepoll_put_events(self, evs, nevs);
+    return elist;
+}
 
+/* The handler of an event, borrowed, or NULL if an earlier handler
+   unregistered its fd or registered it again.  An fd without a handler
+   raises TypeError: NULL with an exception set. */
 static PyObject *
-pyepoll_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+pyepoll_handler(pyEpoll_Object *self, struct epoll_event *ev)
 {
-    int sizehint = -1;
-    static char *kwlist[] = {"sizehint", NULL};
+    int fd = PYEPOLL_TAG_FD(ev->data.u64);
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:epoll", kwlist,
-                                     &sizehint))
+    if (pyepoll_stale(self, ev->data.u64) ||
+        fd < 0 || fd >= self->nslots || !self->slots[fd].registered)
         return NULL;
-
-    return newPyEpoll_Object(type, sizehint, -1);
+    if (self->slots[fd].data == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "fd %d was registered without a handler", fd);
+        return NULL;
+    }
+    return self->slots[fd].data;
 }
 
-
-static void
-pyepoll_dealloc(pyEpoll_Object *self)
+/* Call the handler of every event with its mask.  *hargs is the argument
+   tuple, reused unless a handler kept it.  Returns -1 with an exception
+   set if a handler raised. */
+static int
+pyepoll_dispatch_each(pyEpoll_Object *self, struct epoll_event *evs,
+                      int nfds, PyObject **hargs, long *count)
 {
-    (void)pyepoll_internal_close(self);
-    Py_TYPE(self)->tp_free(self);
-}
+    PyObject *handler, *mask, *res;
+    int i;
 
-static PyObject*
-pyepoll_close(pyEpoll_Object *self)
-{
-    errno = pyepoll_internal_close(self);
-    if (errno < 0) {
-        PyErr_SetFromErrno(PyExc_IOError);
-        return NULL;
+    for (i = 0; i < nfds && !self->stopping; i++) {
+        handler = pyepoll_handler(self, &evs[i]);
+        if (handler == NULL) {
+            if (PyErr_Occurred())
+                return -1;
+            continue;
+        }
+        if (*hargs == NULL || Py_REFCNT(*hargs) > 1) {
+            Py_XDECREF(*hargs);
+            *hargs = PyTuple_New(1);
+            if (*hargs == NULL)
+                return -1;
+        }
+        mask = Py_BuildValue("I", evs[i].events);
+        if (mask == NULL)
+            return -1;
+        Py_XDECREF(PyTuple_GET_ITEM(*hargs, 0));
+        PyTuple_SET_ITEM(*hargs, 0, mask);
+        Py_INCREF(handler);
+        res = PyObject_Call(handler, *hargs, NULL);
+        Py_DECREF(handler);
+        if (res == NULL)
+            return -1;
+        Py_DECREF(res);
+        (*count)++;
     }
-    Py_RETURN_NONE;
+    return 0;
 }
 
-PyDoc_STRVAR(pyepoll_close_doc,
-"close() -> None\n\
-\n\
-Close the epoll control file descriptor. Further operations on the epoll\n\
-object will raise an exception.");
+/* An event of batched dispatch, and a run of them with one handler */
+typedef struct {
+    PyObject *handler;                  /* owned */
+    int index;                          /* in evs */
+} pyepoll_dispatch_entry;
 
-static PyObject*
-pyepoll_get_closed(pyEpoll_Object *self)
+typedef struct {
+    int start;                          /* first entry */
+    int len;
+    int first;                          /* index of the first event */
+} pyepoll_dispatch_group;
+
+static int
+pyepoll_entry_cmp(const void *a, const void *b)
 {
-    if (self->epfd < 0)
-        Py_RETURN_TRUE;
-    else
-        Py_RETURN_FALSE;
+    const pyepoll_dispatch_entry *x = a, *y = b;
+
+    if (x->handler != y->handler)
+        return (Py_uintptr_t)x->handler < (Py_uintptr_t)y->handler ? -1 : 1;
+    return x->index - y->index;
 }
 
-static PyObject*
-pyepoll_fileno(pyEpoll_Object *self)
+static int
+pyepoll_group_cmp(const void *a, const void *b)
 {
-    if (self->epfd < 0)
-        return pyepoll_err_closed();
-    return PyInt_FromLong(self->epfd);
+    const pyepoll_dispatch_group *x = a, *y = b;
+
+    return x->first - y->first;
 }
 
-PyDoc_STRVAR(pyepoll_fileno_doc,
-"fileno() -> int\n\
-\n\
-Return the epoll control file descriptor.");
+static PyObject *pyepoll_array_type = NULL;
 
-static PyObject*
-pyepoll_fromfd(PyObject *cls, PyObject *args)
+/* Call every handler once with an array('I') of the fds and masks of its
+   events, in the order of the handlers' first events.  A handler's
+   events are gathered again right before its call, so those an earlier
+   handler made stale are left out.  Returns -1 with an exception set on
+   failure. */
+static int
+pyepoll_dispatch_batch(pyEpoll_Object *self, struct epoll_event *evs,
+                       int nfds, long *count)
 {
-    SOCKET fd;
+    pyepoll_dispatch_entry *entries;
+    pyepoll_dispatch_group *groups;
+    unsigned int *pairs;
+    PyObject *handler, *arr, *res;
+    int i, j, k, n = 0, ngroups = 0, result = -1;
+
+    if (pyepoll_array_type == NULL) {
+        PyObject *mod = PyImport_ImportModule("array");
+        if (mod == NULL)
+            return -1;
+        pyepoll_array_type = PyObject_GetAttrString(mod, "array");
+        Py_DECREF(mod);
+        if (pyepoll_array_type == NULL)
+            return -1;
+    }
+    if (nfds == 0)
+        return 0;
+    entries = PyMem_New(pyepoll_dispatch_entry, nfds);
+    groups = PyMem_New(pyepoll_dispatch_group, nfds);
+    pairs = PyMem_New(unsigned int, 2 * nfds);
+    if (entries == NULL || groups == NULL || pairs == NULL) {
+        PyErr_NoMemory();
+        goto finally;
+    }
 
-    if (!PyArg_ParseTuple(args, "i:fromfd", &fd))
-        return NULL;
+    for (i = 0; i < nfds; i++) {
+        handler = pyepoll_handler(self, &evs[i]);
+        if (handler == NULL) {
+            if (PyErr_Occurred())
+                goto finally;
+            continue;
+        }
+        /* a handler that is unregistered meanwhile stays alive */
+        Py_INCREF(handler);
+        entries[n].handler = handler;
+        entries[n].index = i;
+        n++;
+    }
+    qsort(entries, n, sizeof(pyepoll_dispatch_entry), pyepoll_entry_cmp);
+    for (i = 0; i < n; i++) {
+        if (i == 0 || entries[i].handler != entries[i - 1].handler) {
+            groups[ngroups].start = i;
+            groups[ngroups].len = 0;
+            groups[ngroups].first = entries[i].index;
+            ngroups++;
+        }
+        groups[ngroups - 1].len++;
+    }
+    qsort(groups, ngroups, sizeof(pyepoll_dispatch_group),
+          pyepoll_group_cmp);
+
+    for (i = 0; i < ngroups && !self->stopping; i++) {
+        handler = entries[groups[i].start].handler;
+        k = 0;
+        for (j = groups[i].start; j < groups[i].start + groups[i].len; j++) {
+            struct epoll_event *ev = &evs[entries[j].index];
+            if (pyepoll_handler(self, ev) != handler) {
+                if (PyErr_Occurred())
+                    goto finally;
+                continue;
+            }
+            pairs[k++] = PYEPOLL_TAG_FD(ev->data.u64);
+            pairs[k++] = ev->events;
+        }
+        if (k == 0)
+            continue;
+        arr = PyObject_CallFunction(pyepoll_array_type, "cs#", 'I',
+                                    (char *)pairs,
+                                    (int)(k * sizeof(unsigned int)));
+        if (arr == NULL)
+            goto finally;
+        res = PyObject_CallFunctionObjArgs(handler, arr, NULL);
+        Py_DECREF(arr);
+        if (res == NULL)
+            goto finally;
+        Py_DECREF(res);
+        (*count)++;
+    }
+    result = 0;
 
-    return newPyEpoll_Object((PyTypeObject*)cls, -1, fd);
+  finally:
+    if (entries != NULL) {
+        for (i = 0; i < n; i++)
+            Py_DECREF(entries[i].handler);
+    }
+    PyMem_Free(entries);
+    PyMem_Free(groups);
+    PyMem_Free(pairs);
+    return result;
 }
 
-PyDoc_STRVAR(pyepoll_fromfd_doc,
-"fromfd(fd) -> epoll\n\
-\n\
-Create an epoll object from a given control fd.");
-
-static PyObject *
-pyepoll_internal_ctl(int epfd, int op, PyObject *pfd, unsigned int events)
+/* Create the eventfd of stop() and register it in epfd.  Returns -1 with
+   an exception set on failure. */
+static int
+pyepoll_wakefd_create(pyEpoll_Object *self)
 {
     struct epoll_event ev;
-    int result;
     int fd;
 
-    if (epfd < 0)
-        return pyepoll_err_closed();
-
-    fd = PyObject_AsFileDescriptor(pfd);
-    if (fd == -1) {
-        return NULL;
-    }
-
-    switch(op) {
-        case EPOLL_CTL_ADD:
-        case EPOLL_CTL_MOD:
-        ev.events = events;
-        ev.data.fd = fd;
-        Py_BEGIN_ALLOW_THREADS
-        result = epoll_ctl(epfd, op, fd, &ev);
-        Py_END_ALLOW_THREADS
-        break;
-        case EPOLL_CTL_DEL:
-        /* In kernel versions before 2.6.9, the EPOLL_CTL_DEL
-         * operation required a non-NULL pointer in event, even
-         * though this argument is ignored. */
-        Py_BEGIN_ALLOW_THREADS
-        result = epoll_ctl(epfd, op, fd, &ev);
-        if (errno == EBADF) {
-            /* fd already closed */
-            result = 0;
-            errno = 0;
-        }
-        Py_END_ALLOW_THREADS
-        break;
-        default:
-        result = -1;
-        errno = EINVAL;
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
     }
-
-    if (result < 0) {
+    ev.events = EPOLLIN;
+    ev.data.u64 = PYEPOLL_TAG(fd, 0);
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
         PyErr_SetFromErrno(PyExc_IOError);
-        return NULL;
+        close(fd);
+        return -1;
     }
-    Py_RETURN_NONE;
+    self->wakefd = fd;
+    return 0;
 }
 
 static PyObject *
-pyepoll_register(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
+pyepoll_run(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *pfd;
-    unsigned int events = EPOLLIN | EPOLLOUT | EPOLLPRI;
-    static char *kwlist[] = {"fd", "eventmask", NULL};
+    PyObject *until_obj = Py_None, *hargs = NULL;
+    double until = 0., left;
+    struct timespec ts, *tsp;
+    struct timeval tv;
+    struct epoll_event *evs;
+    int maxevents, batched, batch = 0, nfds, nevs, result;
+    long count = 0;
+    static char *kwlist[] = {"until", "batch", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|I:register", kwlist,
-                                     &pfd, &events)) {
+    if (self->epfd < 0)
+        return pyepoll_err_closed();
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oi:run", kwlist,
+                                     &until_obj, &batch)) {
+        return NULL;
+    }
+    if (until_obj != Py_None) {
+        until = PyFloat_AsDouble(until_obj);
+        if (until == -1. && PyErr_Occurred())
+            return NULL;
+    }
+    if (self->running) {
+        PyErr_SetString(PyExc_RuntimeError, "run() is already running");
+        return NULL;
+    }
+    if (self->wakefd < 0 && pyepoll_wakefd_create(self) < 0)
         return NULL;
+    self->running = 1;
+
+    while (!self->stopping && self->epfd >= 0) {
+        tsp = NULL;
+        if (until_obj != Py_None) {
+            gettimeofday(&tv, NULL);
+            left = until - (tv.tv_sec + tv.tv_usec * 1e-6);
+            if (left <= 0.)
+                break;
+            if (select_timespec_d(left, &ts) < 0)
+                goto error;
+            tsp = &ts;
+        }
+        batched = self->adaptive;
+        maxevents = batched ? self->batch : FD_SETSIZE-1;
+        nfds = pyepoll_fetch(self, maxevents, batched, tsp, &evs, &nevs);
+        if (nfds < 0) {
+            /* a signal whose handler didn't raise */
+            if (nfds == -2) {
+                PyErr_Clear();
+                continue;
+            }
+            goto error;
+        }
+        if (batch)
+            result = pyepoll_dispatch_batch(self, evs, nfds, &count);
+        else
+            result = pyepoll_dispatch_each(self, evs, nfds, &hargs, &count);
+        pyepoll_put_events(self, evs, nevs);
+        if (result < 0)
+            goto error;
     }
 
-    return pyepoll_internal_ctl(self->epfd, EPOLL_CTL_ADD, pfd, events);
+    Py_XDECREF(hargs);
+    self->running = self->stopping = 0;
+    return PyInt_FromLong(count);
+
+  error:
+    Py_XDECREF(hargs);
+    self->running = self->stopping = 0;
+    return NULL;
 }
 
-PyDoc_STRVAR(pyepoll_register_doc,
-"register(fd[, eventmask]) -> bool\n\
+PyDoc_STRVAR(pyepoll_run_doc,
+"run([until=None[, batch=False]]) -> int\n\
 \n\
-Registers a new fd or modifies an already registered fd. register() returns\n\
-True if a new fd was registered or False if the event mask for fd was modified.\n\
-fd is the target file descriptor of the operation.\n\
-events is a bit set composed of the various EPOLL constants; the default\n\
-is EPOLL_IN | EPOLL_OUT | EPOLL_PRI.\n\
+Wait for events and dispatch them until stop() is called, a handler\n\
+raises, or the time until (as returned by time.time()) has come. The\n\
+handler of an fd is the data object it was registered with; it is\n\
+called with the event mask, and an fd without one makes run() raise\n\
+TypeError. The events are taken as poll() would, and handed on without\n\
+building (fd, events) tuples. Returns the number of handler calls.\n\
 \n\
-The epoll interface supports all file descriptors that support poll.");
+With batch=True, each handler is called once per wakeup with an\n\
+array('I') of fd, mask pairs: all the events of the fds registered with\n\
+it, so a handler shared by many fds costs one call per batch.");
 
 static PyObject *
-pyepoll_modify(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
+pyepoll_stop(pyEpoll_Object *self)
 {
-    PyObject *pfd;
-    unsigned int events;
-    static char *kwlist[] = {"fd", "eventmask", NULL};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OI:modify", kwlist,
-                                     &pfd, &events)) {
-        return NULL;
+    uint64_t one = 1;
+
+    if (self->running) {
+        self->stopping = 1;
+        /* wake up a run() blocked in another thread; a full counter
+           means it is woken already */
+        if (self->wakefd >= 0 &&
+            write(self->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            return PyErr_SetFromErrno(PyExc_IOError);
     }
-
-    return pyepoll_internal_ctl(self->epfd, EPOLL_CTL_MOD, pfd, events);
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(pyepoll_modify_doc,
-"modify(fd, eventmask) -> None\n\
+PyDoc_STRVAR(pyepoll_stop_doc,
+"stop() -> None\n\
 \n\
-fd is the target file descriptor of the operation\n\
-events is a bit set composed of the various EPOLL constants");
+Make run() return once the running handler is done. Called from another\n\
+thread, it wakes up a run() waiting for events.");
 
-static PyObject *
-pyepoll_unregister(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
+PyDoc_STRVAR(pyepoll_poll_doc,
+"poll([timeout=-1[, maxevents=-1]]) -> [(fd, events), (...)]\n\
+\n\
+Wait for events on the epoll file descriptor for a maximum time of timeout\n\
+in seconds (as float), rounded up to the resolution the system can wait\n\
+with. -1 makes poll wait indefinitely.\n\
+Up to maxevents are returned to the caller. If the epoll object was\n\
+created with adaptive=True, the default maxevents follows the load: it\n\
+grows while calls fill it and shrinks while they stay light. The pending\n\
+attribute tells whether the call returned a full batch, so more events\n\
+may be ready. A descriptor registered with data is reported as that\n\
+object.");
+
+/* Size of an entry written by poll_into(): an int fd and an unsigned int
+   event mask, or a struct epoll_event if raw. */
+#define PYEPOLL_PAIR_SIZE       (sizeof(int) + sizeof(unsigned int))
+
+/* Get the address and size of a writable buffer.  The new buffer
+   protocol keeps the buffer from being resized while view is held; an
+   object that only has the old one must be asked again after the GIL
+   was released.  Returns -1 with an exception set on failure. */
+static int
+pyepoll_get_buffer(PyObject *obj, Py_buffer *view, int *have_view,
+                   char **buf, Py_ssize_t *len)
 {
-    PyObject *pfd;
-    static char *kwlist[] = {"fd", NULL};
+    void *ptr;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:unregister", kwlist,
-                                     &pfd)) {
-        return NULL;
+#if PY_VERSION_HEX >= 0x02060000
+    if (PyObject_CheckBuffer(obj)) {
+        if (PyObject_GetBuffer(obj, view, PyBUF_WRITABLE) < 0)
+            return -1;
+        *have_view = 1;
+        *buf = view->buf;
+        *len = view->len;
+        return 0;
     }
-
-    return pyepoll_internal_ctl(self->epfd, EPOLL_CTL_DEL, pfd, 0);
+#endif
+    *have_view = 0;
+    if (PyObject_AsWriteBuffer(obj, &ptr, len) < 0)
+        return -1;
+    *buf = ptr;
+    return 0;
 }
 
-PyDoc_STRVAR(pyepoll_unregister_doc,
-"unregister(fd) -> None\n\
-\n\
-fd is the target file descriptor of the operation.");
-
 static PyObject *
-pyepoll_poll(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
+pyepoll_poll_into(pyEpoll_Object *self, PyObject *args, PyObject *kwds)
 {
+    PyObject *obj;
     double dtimeout = -1.;
-    int timeout;
-    int maxevents = -1;
-    int nfds, i;
-    PyObject *elist = NULL, *etuple = NULL;
-    struct epoll_event *evs = NULL;
-    static char *kwlist[] = {"timeout", "maxevents", NULL};
+    struct timespec ts, *tsp = NULL;
+    int raw = 0, have_view = 0, maxevents, nfds, nevs, i, fd;
+    Py_ssize_t size, len;
+    char *buf;
+    struct epoll_event *evs;
+    Py_buffer view;
+    static char *kwlist[] = {"buffer", "timeout", "raw", NULL};
 
     if (self->epfd < 0)
         return pyepoll_err_closed();
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|di:poll", kwlist,
-                                     &dtimeout, &maxevents)) {
-        return NULL;
-    }
-
-    if (dtimeout < 0) {
-        timeout = -1;
-    }
-    else if (dtimeout * 1000.0 > INT_MAX) {
-        PyErr_SetString(PyExc_OverflowError,
-                        "timeout is too large");
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|di:poll_into", kwlist,
+                                     &obj, &dtimeout, &raw)) {
         return NULL;
     }
-    else {
-        timeout = (int)(dtimeout * 1000.0);
-    }
 
-    if (maxevents == -1) {
-        maxevents = FD_SETSIZE-1;
-    }
-    else if (maxevents < 1) {
-        PyErr_Format(PyExc_ValueError,
-                     "maxevents must be greater than 0, got %d",
-                     maxevents);
-        return NULL;
+    if (dtimeout >= 0) {
+        if (select_timespec_d(dtimeout, &ts) < 0)
+            return NULL;
+        tsp = &ts;
     }
 
-    evs = PyMem_New(struct epoll_event, maxevents);
-    if (evs == NULL) {
-        Py_DECREF(self);
-        PyErr_NoMemory();
+    size = raw ? sizeof(struct epoll_event) : PYEPOLL_PAIR_SIZE;
+    if (pyepoll_get_buffer(obj, &view, &have_view, &buf, &len) < 0)
         return NULL;
-    }
-
-    Py_BEGIN_ALLOW_THREADS
-    nfds = epoll_wait(self->epfd, evs, maxevents, timeout);
-    Py_END_ALLOW_THREADS
-    if (nfds < 0) {
-        PyErr_SetFromErrno(PyExc_IOError);
+    if (len / size < 1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "buffer is too small for a single event");
         goto error;
     }
+    maxevents = len / size > INT_MAX ? INT_MAX : (int)(len / size);
 
-    elist = PyList_New(nfds);
-    if (elist == NULL) {
+    nfds = pyepoll_fetch(self, maxevents, 0, tsp, &evs, &nevs);
+    if (nfds < 0)
         goto error;
-    }
 
-    for (i = 0; i < nfds; i++) {
-        etuple = Py_BuildValue("iI", evs[i].data.fd, evs[i].events);
-        if (etuple == NULL) {
-            Py_CLEAR(elist);
-            goto error;
+    if (!have_view) {
+        if (PyObject_AsWriteBuffer(obj, (void **)&buf, &len) < 0)
+            goto error_events;
+        if (len / size < nfds) {
+            PyErr_SetString(PyExc_ValueError,
+                            "buffer shrank during poll_into()");
+            goto error_events;
+        }
+    }
+    /* the buffer needn't be aligned */
+    if (raw) {
+        memcpy(buf, evs, nfds * sizeof(struct epoll_event));
+    }
+    else {
+        for (i = 0; i < nfds; i++) {
+            fd = PYEPOLL_TAG_FD(evs[i].data.u64);
+            memcpy(buf, &fd, sizeof(int));
+            memcpy(buf + sizeof(int), &evs[i].events, sizeof(unsigned int));
+            buf += PYEPOLL_PAIR_SIZE;
         }
-        PyList_SET_ITEM(elist, i, etuple);
     }
 
-    error:
-    PyMem_Free(evs);
-    return elist;
+    pyepoll_put_events(self, evs, nevs);
+#if PY_VERSION_HEX >= 0x02060000
+    if (have_view)
+        PyBuffer_Release(&view);
+#endif
+    return PyInt_FromLong(nfds);
+
+  error_events:
+    pyepoll_put_events(self, evs, nevs);
+  error:
+#if PY_VERSION_HEX >= 0x02060000
+    if (have_view)
+        PyBuffer_Release(&view);
+#endif
+    return NULL;
 }
 
-PyDoc_STRVAR(pyepoll_poll_doc,
-"poll([timeout=-1[, maxevents=-1]]) -> [(fd, events), (...)]\n\
+PyDoc_STRVAR(pyepoll_poll_into_doc,
+"poll_into(buffer[, timeout=-1[, raw=False]]) -> int\n\
 \n\
-Wait for events on the epoll file descriptor for a maximum time of timeout\n\
-in seconds (as float). -1 makes poll wait indefinitely.\n\
-Up to maxevents are returned to the caller.");
+Like poll(), but write the events into buffer, a writable object such as\n\
+an array('i') or a bytearray, and return their number instead of\n\
+building a list. Each event takes two native ints, the fd and the event\n\
+mask; with raw=True it is a struct epoll_event of EPOLL_EVENT_SIZE bytes\n\
+instead, whose data holds the fd in its low 32 bits. As many events are\n\
+returned as fit into the buffer. The data objects of register() aren't\n\
+used here: the fd is always written.");
 
 static PyMethodDef pyepoll_methods[] = {
     {"fromfd",          (PyCFunction)pyepoll_fromfd,
@@ -1058,23 +4440,142 @@ static PyMethodDef pyepoll_methods[] = {
      METH_VARARGS | METH_KEYWORDS,      pyepoll_unregister_doc},
     {"poll",            (PyCFunction)pyepoll_poll,
      METH_VARARGS | METH_KEYWORDS,      pyepoll_poll_doc},
+    {"poll_into",       (PyCFunction)pyepoll_poll_into,
+     METH_VARARGS | METH_KEYWORDS,      pyepoll_poll_into_doc},
+    {"register_many",   (PyCFunction)pyepoll_register_many,
+     METH_O,    pyepoll_register_many_doc},
+    {"modify_many",     (PyCFunction)pyepoll_modify_many,
+     METH_O,    pyepoll_modify_many_doc},
+    {"unregister_many", (PyCFunction)pyepoll_unregister_many,
+     METH_O,    pyepoll_unregister_many_doc},
+    {"get_mask",        (PyCFunction)pyepoll_get_mask,
+     METH_O,    pyepoll_get_mask_doc},
+    {"flush",           (PyCFunction)pyepoll_flush,
+     METH_NOARGS,       pyepoll_flush_doc},
+    {"forget",          (PyCFunction)pyepoll_forget,
+     METH_O,    pyepoll_forget_doc},
+    {"done",            (PyCFunction)pyepoll_done,
+     METH_O,    pyepoll_done_doc},
+    {"mark_drained",    (PyCFunction)pyepoll_mark_drained,
+     METH_VARARGS | METH_KEYWORDS,      pyepoll_mark_drained_doc},
+    {"set_budget",      (PyCFunction)pyepoll_set_budget,
+     METH_VARARGS,      pyepoll_set_budget_doc},
+    {"set_spin",        (PyCFunction)pyepoll_set_spin,
+     METH_VARARGS,      pyepoll_set_spin_doc},
+    {"set_busy_poll",   (PyCFunction)pyepoll_set_busy_poll,
+     METH_VARARGS | METH_KEYWORDS,      pyepoll_set_busy_poll_doc},
+    {"get_busy_poll",   (PyCFunction)pyepoll_get_busy_poll,
+     METH_NOARGS,       pyepoll_get_busy_poll_doc},
+    {"run",             (PyCFunction)pyepoll_run,
+     METH_VARARGS | METH_KEYWORDS,      pyepoll_run_doc},
+    {"stop",            (PyCFunction)pyepoll_stop,
+     METH_NOARGS,       pyepoll_stop_doc},
     {NULL,      NULL},
 };
 
+static PyObject*
+pyepoll_get_pending(pyEpoll_Object *self)
+{
+    return PyBool_FromLong(self->pending);
+}
+
+static PyObject*
+pyepoll_get_batch(pyEpoll_Object *self)
+{
+    return PyInt_FromLong(self->batch);
+}
+
+static PyObject*
+pyepoll_get_spin_hits(pyEpoll_Object *self)
+{
+    return PyLong_FromUnsignedLong(self->spin_hits);
+}
+
+static PyObject*
+pyepoll_get_spin_misses(pyEpoll_Object *self)
+{
+    return PyLong_FromUnsignedLong(self->spin_misses);
+}
+
 static PyGetSetDef pyepoll_getsetlist[] = {
     {"closed", (getter)pyepoll_get_closed, NULL,
      "True if the epoll handler is closed"},
+    {"pending", (getter)pyepoll_get_pending, NULL,
+     "True if the last poll() returned as many events as it could take"},
+    {"batch", (getter)pyepoll_get_batch, NULL,
+     "maxevents of the next adaptive poll()"},
+    {"spin_hits", (getter)pyepoll_get_spin_hits, NULL,
+     "spins that found events, see set_spin()"},
+    {"spin_misses", (getter)pyepoll_get_spin_misses, NULL,
+     "spins that found no events, see set_spin()"},
     {0},
 };
 
 PyDoc_STRVAR(pyepoll_doc,
-"select_backport.epoll([sizehint=-1])\n\
+"select_backport.epoll([sizehint=-1], *, adaptive=False, deferred=False,\n\
+                      sticky=False)\n\
 \n\
 Returns an epolling object\n\
 \n\
 sizehint must be a positive integer or -1 for the default size. The\n\
 sizehint is used to optimize internal data structures. It doesn't limit\n\
-the maximum number of monitored events.");
+the maximum number of monitored events.\n\
+adaptive makes poll() size its batches from the load, see poll().\n\
+\n\
+The object keeps a record of what is registered through it: len(), `in`,\n\
+iteration (over the fds, in order) and get_mask() read it, and modify()\n\
+with an unchanged mask skips the system call, unless the mask has\n\
+EPOLLONESHOT or EPOLLET, which modify() rearms.\n\
+\n\
+With deferred=True, register(), modify() and unregister() only update\n\
+that record; the changes are coalesced per fd and handed to the kernel\n\
+by the next poll() or flush(). poll() raises IOError, with the fd as\n\
+filename, if one of them fails.\n\
+\n\
+Every registration is tagged with a generation, so a descriptor can be\n\
+closed and forgotten instead of unregistered: poll() drops the events\n\
+left over from its earlier registrations.\n\
+\n\
+With sticky=True, the fds are registered edge-triggered (EPOLLET is\n\
+added to their masks), but poll() keeps reporting an fd's events until\n\
+mark_drained() says a read or write returned EAGAIN, as level-triggered\n\
+epoll would. poll() doesn't wait while such events are left.\n\
+\n\
+register() takes a priority class, 0 to 3; poll() returns the events of\n\
+the higher classes first, each within the budget of set_budget().");
+
+/* An epoll object stays true when nothing is registered, as it was before
+   it had a length. */
+static int
+pyepoll_nonzero(pyEpoll_Object *self)
+{
+    return 1;
+}
+
+static PyNumberMethods pyepoll_as_number = {
+    0,                                                  /* nb_add */
+    0,                                                  /* nb_subtract */
+    0,                                                  /* nb_multiply */
+    0,                                                  /* nb_divide */
+    0,                                                  /* nb_remainder */
+    0,                                                  /* nb_divmod */
+    0,                                                  /* nb_power */
+    0,                                                  /* nb_negative */
+    0,                                                  /* nb_positive */
+    0,                                                  /* nb_absolute */
+    (inquiry)pyepoll_nonzero,                           /* nb_nonzero */
+};
+
+static PySequenceMethods pyepoll_as_sequence = {
+    (lenfunc)pyepoll_length,                            /* sq_length */
+    0,                                                  /* sq_concat */
+    0,                                                  /* sq_repeat */
+    0,                                                  /* sq_item */
+    0,                                                  /* sq_slice */
+    0,                                                  /* sq_ass_item */
+    0,                                                  /* sq_ass_slice */
+    (objobjproc)pyepoll_contains,                       /* sq_contains */
+};
 
 static PyTypeObject pyEpoll_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
@@ -1087,8 +4588,8 @@ static PyTypeObject pyEpoll_Type = {
     0,                                                  /* tp_setattr */
     0,                                                  /* tp_compare */
     0,                                                  /* tp_repr */
-    0,                                                  /* tp_as_number */
-    0,                                                  /* tp_as_sequence */
+    &pyepoll_as_number,                                 /* tp_as_number */
+    &pyepoll_as_sequence,                               /* tp_as_sequence */
     0,                                                  /* tp_as_mapping */
     0,                                                  /* tp_hash */
     0,                                                  /* tp_call */
@@ -1096,13 +4597,13 @@ static PyTypeObject pyEpoll_Type = {
     PyObject_GenericGetAttr,                            /* tp_getattro */
     0,                                                  /* tp_setattro */
     0,                                                  /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,                                 /* tp_flags */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,            /* tp_flags */
     pyepoll_doc,                                        /* tp_doc */
-    0,                                                  /* tp_traverse */
-    0,                                                  /* tp_clear */
+    (traverseproc)pyepoll_traverse,                     /* tp_traverse */
+    (inquiry)pyepoll_tp_clear,                          /* tp_clear */
     0,                                                  /* tp_richcompare */
     0,                                                  /* tp_weaklistoffset */
-    0,                                                  /* tp_iter */
+    (getiterfunc)pyepoll_iter,                          /* tp_iter */
     0,                                                  /* tp_iternext */
     pyepoll_methods,                                    /* tp_methods */
     0,                                                  /* tp_members */
@@ -1730,6 +5231,8 @@ xlist -- wait for an ``exceptional condition''\n\
 If only one kind of condition is required, pass [] for the other lists.\n\
 A file descriptor is either a socket or file object, or a small integer\n\
 gotten from a fileno() method call on one of those.\n\
+Any of the three arguments may also be an FdSet, which saves converting\n\
+the sequence on every call.\n\
 \n\
 The optional 4th argument specifies a timeout in seconds; it may be\n\
 a floating point number to specify fractions of seconds.  If it is absent\n\
@@ -1743,10 +5246,150 @@ that are ready.\n\
 On Windows and OpenVMS, only sockets are supported; on Unix, all file\n\
 descriptors can be used.");
 
+static PyObject *
+select_select(PyObject *self, PyObject *args)
+{
+    return select_internal(args, "select", 0);
+}
+
+#ifdef HAVE_PSELECT
+PyDoc_STRVAR(pselect_doc,
+"pselect(rlist, wlist, xlist[, timeout[, sigmask]]) -> (rlist, wlist, xlist)\n\
+\n\
+Like select(), but the timeout has nanosecond resolution and sigmask is\n\
+an iterable of signal numbers that are unblocked while waiting. The\n\
+signal mask is changed and restored atomically with the wait, so a\n\
+signal blocked outside of pselect() can't be lost between checking for\n\
+work and going to sleep. None leaves the signal mask alone.");
+
+static PyObject *
+select_pselect(PyObject *self, PyObject *args)
+{
+    return select_internal(args, "pselect", SELECT_PSELECT);
+}
+#endif /* HAVE_PSELECT */
+
+PyDoc_STRVAR(select_bits_doc,
+"select_bits(rlist, wlist, xlist[, timeout]) -> (rbits, wbits, xbits)\n\
+\n\
+Like select(), but returns the three fd sets as filled in by the kernel,\n\
+as strings of native unsigned longs; bit n of the set is descriptor n.\n\
+Use bits_isset() and bits_to_list() to read them.");
+
+static PyObject *
+select_select_bits(PyObject *self, PyObject *args)
+{
+    return select_internal(args, "select_bits", SELECT_BITS);
+}
+
+/* Parse a bitmap argument; returns the number of words, -1 on error. */
+static Py_ssize_t
+select_parse_bits(PyObject *args, const char *fmt, const char **bits,
+                  SOCKET *fd)
+{
+    int len;                            /* no PY_SSIZE_T_CLEAN here */
+
+    if (fd == NULL) {
+        if (!PyArg_ParseTuple(args, fmt, bits, &len))
+            return -1;
+    }
+    else if (!PyArg_ParseTuple(args, fmt, bits, &len, fd))
+        return -1;
+    if (len % sizeof(unsigned long)) {
+        PyErr_Format(PyExc_ValueError,
+                     "bitmap length must be a multiple of %d",
+                     (int)sizeof(unsigned long));
+        return -1;
+    }
+    return len / sizeof(unsigned long);
+}
+
+PyDoc_STRVAR(select_bits_isset_doc,
+"bits_isset(bits, fd) -> bool\n\
+\n\
+Return True if fd is set in a bitmap returned by select_bits().");
+
+static PyObject *
+select_bits_isset(PyObject *self, PyObject *args)
+{
+    const char *bits;
+    unsigned long word;
+    Py_ssize_t nwords;
+    SOCKET fd;
+
+    nwords = select_parse_bits(args, "s#i:bits_isset", &bits, &fd);
+    if (nwords < 0)
+        return NULL;
+    if (fd < 0 || fd / SELECT_NBITS >= nwords)
+        Py_RETURN_FALSE;
+    /* the string data isn't necessarily aligned */
+    memcpy(&word, bits + fd / SELECT_NBITS * sizeof(unsigned long),
+           sizeof(unsigned long));
+    return PyBool_FromLong((word >> (fd % SELECT_NBITS)) & 1UL);
+}
+
+PyDoc_STRVAR(select_bits_to_list_doc,
+"bits_to_list(bits) -> list of ints\n\
+\n\
+Return the descriptors set in a bitmap returned by select_bits(),\n\
+in ascending order.");
+
+static PyObject *
+select_bits_to_list(PyObject *self, PyObject *args)
+{
+    const char *bits;
+    unsigned long word;
+    Py_ssize_t nwords, w, i = 0, count = 0;
+    PyObject *list, *num;
+
+    nwords = select_parse_bits(args, "s#:bits_to_list", &bits, NULL);
+    if (nwords < 0)
+        return NULL;
+
+    for (w = 0; w < nwords; w++) {
+        memcpy(&word, bits + w * sizeof(unsigned long),
+               sizeof(unsigned long));
+        for (; word; word &= word - 1)
+            count++;
+    }
+    list = PyList_New(count);
+    if (list == NULL)
+        return NULL;
+    for (w = 0; w < nwords; w++) {
+        memcpy(&word, bits + w * sizeof(unsigned long),
+               sizeof(unsigned long));
+        for (; word; word &= word - 1) {
+            num = PyInt_FromLong((long)(w * SELECT_NBITS) +
+                                 SELECT_CTZ(word));
+            if (num == NULL) {
+                Py_DECREF(list);
+                return NULL;
+            }
+            PyList_SET_ITEM(list, i++, num);
+        }
+    }
+    return list;
+}
+
 static PyMethodDef select_backport_methods[] = {
     {"select",          select_select,  METH_VARARGS,   select_doc},
+    {"select_bits",     select_select_bits,     METH_VARARGS,
+     select_bits_doc},
+#ifdef HAVE_PSELECT
+    {"pselect",         select_pselect, METH_VARARGS,   pselect_doc},
+#endif /* HAVE_PSELECT */
+    {"bits_isset",      select_bits_isset,      METH_VARARGS,
+     select_bits_isset_doc},
+    {"bits_to_list",    select_bits_to_list,    METH_VARARGS,
+     select_bits_to_list_doc},
+    {"set_gil_threshold",       select_set_gil_threshold,       METH_VARARGS,
+     set_gil_threshold_doc},
 #ifdef HAVE_POLL
-    {"poll",            select_poll,    METH_NOARGS,    poll_doc},
+    {"poll",            (PyCFunction)select_poll,
+     METH_VARARGS | METH_KEYWORDS,      poll_doc},
+    {"set_poll_threshold",      select_set_poll_threshold,      METH_VARARGS,
+     set_poll_threshold_doc},
+    {"_pollscan",       select_pollscan,        METH_VARARGS,   pollscan_doc},
 #endif /* HAVE_POLL */
     {0,         0},     /* sentinel */
 };
@@ -1773,6 +5416,12 @@ initselect_backport(void)
     PyModule_AddIntConstant(m, "PIPE_BUF", PIPE_BUF);
 #endif
 
+    Py_TYPE(&fdset_Type) = &PyType_Type;
+    if (PyType_Ready(&fdset_Type) < 0)
+        return;
+    Py_INCREF(&fdset_Type);
+    PyModule_AddObject(m, "FdSet", (PyObject *)&fdset_Type);
+
 #if defined(HAVE_POLL)
 #ifdef __APPLE__
     if (select_have_broken_poll()) {
@@ -1784,6 +5433,7 @@ initselect_backport(void)
     {
 #endif
         Py_TYPE(&poll_Type) = &PyType_Type;
+        pollscan_init();
         PyModule_AddIntConstant(m, "POLLIN", POLLIN);
         PyModule_AddIntConstant(m, "POLLPRI", POLLPRI);
         PyModule_AddIntConstant(m, "POLLOUT", POLLOUT);
@@ -1833,6 +5483,8 @@ initselect_backport(void)
     PyModule_AddIntConstant(m, "EPOLLWRNORM", EPOLLWRNORM);
     PyModule_AddIntConstant(m, "EPOLLWRBAND", EPOLLWRBAND);
     PyModule_AddIntConstant(m, "EPOLLMSG", EPOLLMSG);
+    PyModule_AddIntConstant(m, "EPOLL_EVENT_SIZE",
+                            sizeof(struct epoll_event));
 #endif /* HAVE_EPOLL */
 
 #ifdef HAVE_KQUEUE
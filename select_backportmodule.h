@@ -16,5 +16,16 @@
         PyObject_HEAD_INIT(type) size,
 #endif /* !PyVarObject_HEAD_INIT */
 
+/**
+ * Python 2.5 has only the old buffer protocol; the struct lets code
+ * declare a view that it never fills there.
+ */
+#if PY_VERSION_HEX < 0x02060000
+typedef struct {
+    void *buf;
+    Py_ssize_t len;
+} Py_buffer;
+#endif /* PY_VERSION_HEX < 0x02060000 */
+
 #endif
 
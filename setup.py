@@ -33,9 +33,12 @@ MACROS = []
 if "linux" in sys.platform:
     MACROS.append(("HAVE_EPOLL", 1))
     MACROS.append(("HAVE_SYS_EPOLL_H", 1))
+    MACROS.append(("HAVE_PSELECT", 1))
+    MACROS.append(("HAVE_PPOLL", 1))
 elif "darwin" in sys.platform or "bsd" in sys.platform:
     MACROS.append(("HAVE_KQUEUE", 1))
     MACROS.append(("HAVE_SYS_EVENT_H", 1))
+    MACROS.append(("HAVE_PSELECT", 1))
 else:
     raise ValueError("Platform '%s' is not supported" % sys.platform)
 
@@ -24,9 +24,15 @@ Tests for epoll wrapper.
 import os
 import socket
 import errno
+import signal
 import time
 import select_backport as select
 import tempfile
+import threading
+import array
+import struct
+import gc
+import weakref
 import unittest
 from test import test_support
 
@@ -170,6 +176,18 @@ class TestEPoll(unittest.TestCase):
         self.assertRaises(ValueError, select.epoll, -2)
         self.assertRaises(ValueError, select.epoll().register, -1,
                           select.EPOLLIN)
+        # past RLIMIT_NOFILE: EBADF, not a huge slot table
+        ep = select.epoll()
+        for method, args in ((ep.register, ()),
+                             (ep.modify, (select.EPOLLIN,)),
+                             (ep.forget, ())):
+            try:
+                method(10 ** 9, *args)
+            except IOError, e:
+                self.assertEqual(e.errno, errno.EBADF)
+            else:
+                self.fail("%s(10 ** 9) didn't raise EBADF" % method.__name__)
+        ep.close()
 
     def test_unregister_closed(self):
         server, client = self._connected_pair()
@@ -185,6 +203,752 @@ class TestEPoll(unittest.TestCase):
         server.close()
         ep.unregister(fd)
 
+    def test_submillisecond_timeout(self):
+        # a timeout below 1ms must wait, not turn into a busy poll
+        ep = select.epoll(16)
+        ep.register(self.serverSocket.fileno(), select.EPOLLIN)
+        now = time.time()
+        for i in range(50):
+            self.assertEquals(ep.poll(0.0004), [])
+        then = time.time()
+        self.failIf(then - now < 50 * 0.0004, then - now)
+        self.failIf(then - now > 1, then - now)
+
+    def test_concurrent_poll(self):
+        # the event buffer is shared between calls, but threads polling
+        # at the same time must each get their own
+        client, server = self._connected_pair()
+        ep = select.epoll(16)
+        ep.register(server.fileno(), select.EPOLLIN)
+        results = []
+        def waiter():
+            results.append(ep.poll(0.5))
+        threads = [threading.Thread(target=waiter) for i in range(4)]
+        for t in threads:
+            t.start()
+        time.sleep(0.05)
+        client.send("x")
+        for t in threads:
+            t.join()
+        self.assertEquals(len(results), 4)
+        for events in results:
+            self.assertEquals(events, [(server.fileno(), select.EPOLLIN)])
+        self.assertEquals(ep.poll(0, 1), [(server.fileno(), select.EPOLLIN)])
+
+        # closing while another thread waits frees the buffer afterwards
+        t = threading.Thread(target=waiter)
+        ep.unregister(server.fileno())
+        t.start()
+        time.sleep(0.05)
+        ep.close()
+        t.join()
+        self.assertRaises(ValueError, ep.poll, 0)
+
+    def test_adaptive(self):
+        fds = []
+        try:
+            for i in range(80):
+                fds.extend(os.pipe())
+            writers = fds[1::2]
+            ep = select.epoll(adaptive=True)
+            self.assertEquals(ep.batch, 64)
+            self.failIf(ep.pending)
+
+            # more ready than the batch: it grows and says so
+            for fd in writers:
+                ep.register(fd, select.EPOLLOUT)
+            self.assertEquals(len(ep.poll(0)), 64)
+            self.failUnless(ep.pending)
+            self.assertEquals(ep.batch, 128)
+            self.assertEquals(len(ep.poll(0)), 80)
+            self.failIf(ep.pending)
+
+            # light polls shrink it again
+            for fd in writers[1:]:
+                ep.unregister(fd)
+            for i in range(8):
+                self.assertEquals(len(ep.poll(0)), 1)
+            self.assertEquals(ep.batch, 64)
+
+            # an explicit maxevents is left alone; the kernel hands out
+            # level triggered events round robin, so small batches
+            # still cover every descriptor
+            for fd in writers[1:30]:
+                ep.register(fd, select.EPOLLOUT)
+            seen = set()
+            for i in range(3):
+                events = ep.poll(0, 10)
+                self.failUnless(ep.pending)
+                seen.update([fd for fd, mask in events])
+            self.assertEquals(seen, set(writers[:30]))
+            self.assertEquals(ep.batch, 64)
+        finally:
+            for fd in fds:
+                os.close(fd)
+
+    def test_poll_into(self):
+        client, server = self._connected_pair()
+        ep = select.epoll(16)
+        ep.register(server.fileno(), select.EPOLLIN | select.EPOLLOUT)
+        ep.register(client.fileno(), select.EPOLLOUT)
+        client.send("Hello!")
+        expected = [(client.fileno(), select.EPOLLOUT),
+                    (server.fileno(), select.EPOLLIN | select.EPOLLOUT)]
+
+        buf = array.array('i', [0] * 8)
+        n = ep.poll_into(buf, 1)
+        self.assertEquals(n, 2)
+        self.failIf(ep.pending)
+        events = [(buf[2 * i], buf[2 * i + 1]) for i in range(n)]
+        events.sort()
+        self.assertEquals(events, expected)
+
+        # one event fits: the other is still pending
+        buf = bytearray(8)
+        self.assertEquals(ep.poll_into(memoryview(buf), 0), 1)
+        self.failUnless(ep.pending)
+
+        size = select.EPOLL_EVENT_SIZE
+        buf = bytearray(3 * size)
+        n = ep.poll_into(buf, 0, raw=True)
+        self.assertEquals(n, 2)
+        events = []
+        for i in range(n):
+            mask, = struct.unpack_from("=I", buffer(buf), i * size)
+            fd, = struct.unpack_from("=i", buffer(buf), i * size + size - 8)
+            events.append((fd, mask))
+        events.sort()
+        self.assertEquals(events, expected)
+
+        self.assertRaises(ValueError, ep.poll_into, bytearray(4), 0)
+        self.assertRaises((TypeError, BufferError), ep.poll_into,
+                          "immutable", 0)
+        ep.close()
+        self.assertRaises(ValueError, ep.poll_into, bytearray(8), 0)
+
+    def test_data(self):
+        client, server = self._connected_pair()
+        ep = select.epoll(16)
+        conn = object()
+        ep.register(client.fileno(), select.EPOLLOUT, data=conn)
+        ep.register(server, select.EPOLLOUT, 2 ** 63)
+        events = ep.poll(1, 4)
+        self.assertEquals(len(events), 2)
+        self.failUnless((conn, select.EPOLLOUT) in events)
+        self.failUnless((2 ** 63, select.EPOLLOUT) in events)
+
+        # modify() keeps the data unless given, unregister() drops it
+        ep.modify(client.fileno(), select.EPOLLOUT)
+        ep.modify(server.fileno(), select.EPOLLOUT, data="server")
+        events = ep.poll(1, 4)
+        self.failUnless((conn, select.EPOLLOUT) in events)
+        self.failUnless(("server", select.EPOLLOUT) in events)
+        ep.unregister(client.fileno())
+        ep.register(client.fileno(), select.EPOLLOUT)
+        events = ep.poll(1, 4)
+        self.failUnless((client.fileno(), select.EPOLLOUT) in events)
+
+        # a cycle through the data is collected
+        class Holder(object):
+            pass
+        holder = Holder()
+        holder.ep = ep
+        ep.modify(server.fileno(), select.EPOLLOUT, data=holder)
+        ref = weakref.ref(holder)
+        del ep, holder
+        gc.collect()
+        self.failUnless(ref() is None)
+
+    def test_many(self):
+        fds = []
+        try:
+            for i in range(20):
+                fds.extend(os.pipe())
+            writers = fds[1::2]
+            ep = select.epoll()
+            failures = ep.register_many([(fd, select.EPOLLOUT, -fd)
+                                         for fd in writers] +
+                                        [(writers[0], select.EPOLLOUT),
+                                         (fds[0], select.EPOLLIN)])
+            self.assertEquals(failures, [(writers[0], errno.EEXIST)])
+            events = ep.poll(0)
+            events.sort()
+            self.assertEquals(events,
+                              sorted([(-fd, select.EPOLLOUT)
+                                      for fd in writers]))
+
+            failures = ep.modify_many([(fd, select.EPOLLIN)
+                                       for fd in writers[:10]] +
+                                      [(writers[10], select.EPOLLOUT, "x"),
+                                       (fds[2], select.EPOLLIN)])
+            self.assertEquals(failures, [(fds[2], errno.ENOENT)])
+            self.assertEquals(len(ep.poll(0)), 10)
+            self.failUnless(("x", select.EPOLLOUT) in ep.poll(0))
+
+            self.assertEquals(ep.unregister_many(writers + [fds[0]]), [])
+            self.assertEquals(ep.poll(0), [])
+            self.assertEquals(ep.unregister_many([fds[0]]),
+                              [(fds[0], errno.ENOENT)])
+
+            # malformed entries raise before anything is applied
+            self.assertRaises(TypeError, ep.register_many,
+                              [(writers[0], select.EPOLLOUT), writers[1]])
+            self.assertRaises(TypeError, ep.register_many,
+                              [(writers[0], select.EPOLLOUT), ("x", 1)])
+            self.assertEquals(ep.poll(0), [])
+            self.assertEquals(ep.register_many([]), [])
+        finally:
+            for fd in fds:
+                os.close(fd)
+
+    def test_mirror(self):
+        client, server = self._connected_pair()
+        ep = select.epoll()
+        self.assertEquals(len(ep), 0)
+        self.failUnless(ep)
+        ep.register(server, select.EPOLLIN)
+        ep.register_many([(client.fileno(), select.EPOLLOUT)])
+        self.assertEquals(len(ep), 2)
+        self.failUnless(server in ep)
+        self.failUnless(client.fileno() in ep)
+        self.failIf(self.serverSocket in ep)
+        self.assertEquals(list(ep), sorted([client.fileno(),
+                                            server.fileno()]))
+        self.assertEquals(ep.get_mask(server), select.EPOLLIN)
+        ep.modify(server, select.EPOLLIN | select.EPOLLOUT)
+        self.assertEquals(ep.get_mask(server.fileno()),
+                          select.EPOLLIN | select.EPOLLOUT)
+        self.assertRaises(KeyError, ep.get_mask, self.serverSocket)
+
+        # an unchanged mask doesn't reach the kernel: modify() of a
+        # closed descriptor only fails when the mask changes
+        fd = os.dup(client.fileno())
+        ep.register(fd, select.EPOLLOUT)
+        os.close(fd)
+        ep.modify(fd, select.EPOLLOUT)
+        self.assertEquals(ep.modify_many([(fd, select.EPOLLOUT)]), [])
+        self.assertRaises(IOError, ep.modify, fd,
+                          select.EPOLLIN | select.EPOLLOUT)
+        ep.unregister(fd)
+        self.failIf(fd in ep)
+
+        # but an edge-triggered one does: modify() reports pending
+        # readiness again
+        ep.modify(client, select.EPOLLOUT | select.EPOLLET)
+        ready = lambda: [e for e in ep.poll(0) if e[0] == client.fileno()]
+        expected = [(client.fileno(), select.EPOLLOUT)]
+        self.assertEquals(ready(), expected)
+        self.assertEquals(ready(), [])
+        ep.modify(client, select.EPOLLOUT | select.EPOLLET)
+        self.assertEquals(ready(), expected)
+        self.assertEquals(ready(), [])
+        self.assertEquals(ep.modify_many([(client.fileno(),
+                          select.EPOLLOUT | select.EPOLLET)]), [])
+        self.assertEquals(ready(), expected)
+
+        ep.unregister_many([client])
+        ep.unregister(server)
+        self.assertEquals(len(ep), 0)
+        self.assertEquals(list(ep), [])
+        ep.close()
+        self.assertEquals(len(ep), 0)
+
+    def test_deferred(self):
+        fds = []
+        try:
+            for i in range(3):
+                fds.extend(os.pipe())
+            ep = select.epoll(deferred=True)
+            # a second object on the same instance shows what the kernel has
+            kernel = select.epoll.fromfd(os.dup(ep.fileno()))
+
+            ep.register(fds[1], select.EPOLLIN)
+            ep.modify(fds[1], select.EPOLLIN | select.EPOLLOUT)
+            ep.modify(fds[1], select.EPOLLOUT)
+            ep.register(fds[3], select.EPOLLOUT)
+            ep.unregister(fds[3])
+            self.assertEquals(list(ep), [fds[1]])
+            self.assertEquals(kernel.poll(0), [])
+            self.assertRaises(IOError, ep.register, fds[1])
+            self.assertRaises(IOError, ep.modify, fds[3], select.EPOLLOUT)
+            self.assertRaises(IOError, ep.unregister, fds[3])
+
+            self.assertEquals(ep.poll(0), [(fds[1], select.EPOLLOUT)])
+            self.assertEquals(kernel.poll(0), [(fds[1], select.EPOLLOUT)])
+            self.assertEquals(ep.flush(), [])
+
+            # failures are reported against their fd, the rest goes through
+            f = open(__file__)
+            try:
+                ep.register(f, select.EPOLLIN)
+                ep.register_many([(fds[5], select.EPOLLOUT)])
+                try:
+                    ep.poll(0)
+                except IOError, e:
+                    self.assertEquals(e.errno, errno.EPERM)
+                    self.assertEquals(e.filename, f.fileno())
+                    self.assertEquals(e.failures,
+                                      [(f.fileno(), errno.EPERM)])
+                else:
+                    self.fail("poll() didn't report the failed register()")
+                self.failIf(f in ep)
+            finally:
+                f.close()
+            events = ep.poll(0)
+            events.sort()
+            self.assertEquals(events, [(fds[1], select.EPOLLOUT),
+                                       (fds[5], select.EPOLLOUT)])
+
+            self.assertEquals(ep.unregister_many([fds[1], fds[5]]), [])
+            self.assertEquals(len(kernel.poll(0)), 2)
+            self.assertEquals(ep.flush(), [])
+            self.assertEquals(kernel.poll(0), [])
+            kernel.close()
+        finally:
+            for fd in fds:
+                os.close(fd)
+
+    def test_generations(self):
+        ep = select.epoll()
+        fds = []
+        try:
+            r, w = os.pipe()
+            # the alias keeps the pipe's file open, so the kernel goes on
+            # reporting it after close(r)
+            fds.extend([w, os.dup(r)])
+            ep.register(r, select.EPOLLIN)
+            os.write(w, "x")
+            os.close(r)
+            self.assertEquals(ep.poll(0), [(r, select.EPOLLIN)])
+
+            # a new registration of the number hides the old one
+            r2, w2 = os.pipe()
+            fds.extend([r2, w2])
+            self.assertEquals(r2, r)
+            ep.register(r2, select.EPOLLIN)
+            self.assertEquals(ep.poll(0), [])
+            os.write(w2, "x")
+            self.assertEquals(ep.poll(0), [(r2, select.EPOLLIN)])
+            buf = array.array('i', [0] * 4)
+            self.assertEquals(ep.poll_into(buf, 0), 1)
+            self.assertEquals(list(buf[:2]), [r2, select.EPOLLIN])
+
+            # close-only teardown
+            fds.append(os.dup(r2))
+            ep.forget(r2)
+            fds.remove(r2)
+            os.close(r2)
+            self.failIf(r2 in ep)
+            self.assertEquals(len(ep), 0)
+            # the leftover doesn't cut a wait short
+            now = time.time()
+            self.assertEquals(ep.poll(0.2), [])
+            self.failUnless(time.time() - now >= 0.15)
+            ep.forget(r2)
+
+            r3, w3 = os.pipe()
+            fds.extend([r3, w3])
+            self.assertEquals(r3, r2)
+            ep.register(r3, select.EPOLLIN, data="new")
+            os.write(w3, "x")
+            self.assertEquals(ep.poll(0), [("new", select.EPOLLIN)])
+
+            # nor does one of a priority class
+            fds.append(os.dup(r3))
+            ep.unregister(r3)
+            ep.register(r3, select.EPOLLIN, None, 2)
+            ep.forget(r3)
+            now = time.time()
+            self.assertEquals(ep.poll(0.2), [])
+            self.failUnless(time.time() - now >= 0.15)
+
+            # a wait already running sees what is registered meanwhile
+            r4, w4 = os.pipe()
+            fds.extend([r4, w4])
+            result = []
+            waiter = threading.Thread(
+                target=lambda: result.append(ep.poll(2)))
+            now = time.time()
+            waiter.start()
+            time.sleep(0.1)
+            ep.register(r4, select.EPOLLIN)
+            os.write(w4, "x")
+            waiter.join()
+            self.assertEquals(result, [[(r4, select.EPOLLIN)]])
+            self.failUnless(time.time() - now < 1)
+        finally:
+            ep.close()
+            for fd in fds:
+                os.close(fd)
+
+    def test_done(self):
+        for deferred in (False, True):
+            ep = select.epoll(deferred=deferred)
+            r, w = os.pipe()
+            r2, w2 = os.pipe()
+            try:
+                ep.register(r, select.EPOLLIN | select.EPOLLONESHOT)
+                ep.register(w2, select.EPOLLOUT)
+                self.assertRaises(ValueError, ep.done, w2)
+                self.assertRaises(KeyError, ep.done, r2)
+                ep.unregister(w2)
+
+                os.write(w, "x")
+                self.assertEquals(ep.poll(0), [(r, select.EPOLLIN)])
+                self.assertEquals(ep.poll(0), [])
+                self.assertEquals(ep.done(r), True)
+                self.assertEquals(ep.done(r), False)
+                self.assertEquals(ep.poll(0), [(r, select.EPOLLIN)])
+                self.assertEquals(ep.done(r), True)
+                self.assertEquals(ep.flush(), [])
+                self.assertEquals(ep.done(r), False)
+                self.assertEquals(ep.poll(0), [(r, select.EPOLLIN)])
+                # modify() rearms as well
+                ep.modify(r, select.EPOLLIN | select.EPOLLONESHOT)
+                self.assertEquals(ep.done(r), False)
+                self.assertEquals(ep.poll(0), [(r, select.EPOLLIN)])
+            finally:
+                ep.close()
+                for fd in (r, w, r2, w2):
+                    os.close(fd)
+
+    def test_done_threads(self):
+        ep = select.epoll()
+        pipes = [os.pipe() for i in range(8)]
+        lock = threading.Lock()
+        busy = set()
+        handled = [0]
+        errors = []
+        total = len(pipes) * 20
+
+        def worker():
+            while handled[0] < total and not errors:
+                for fd, events in ep.poll(0.05, maxevents=1):
+                    with lock:
+                        if fd in busy:
+                            errors.append(fd)
+                        busy.add(fd)
+                    os.read(fd, 1)
+                    with lock:
+                        busy.discard(fd)
+                        handled[0] += 1
+                    ep.done(fd)
+
+        try:
+            for r, w in pipes:
+                os.write(w, "x" * 20)
+                ep.register(r, select.EPOLLIN | select.EPOLLONESHOT)
+            threads = [threading.Thread(target=worker) for i in range(4)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join(10)
+            self.assertEquals(errors, [])
+            self.assertEquals(handled[0], total)
+        finally:
+            ep.close()
+            for r, w in pipes:
+                os.close(r)
+                os.close(w)
+
+    def test_sticky(self):
+        ep = select.epoll(sticky=True)
+        pipes = [os.pipe() for i in range(3)]
+        try:
+            r, w = pipes[0]
+            ep.register(r, select.EPOLLIN)
+            self.assertEquals(ep.get_mask(r), select.EPOLLIN | select.EPOLLET)
+            os.write(w, "xy")
+            self.assertEquals(ep.poll(0), [(r, select.EPOLLIN)])
+            # reported again although the kernel only saw one edge
+            os.read(r, 1)
+            t = time.time()
+            self.assertEquals(ep.poll(5), [(r, select.EPOLLIN)])
+            self.assert_(time.time() - t < 1)
+            os.read(r, 1)
+            ep.mark_drained(r)
+            self.assertEquals(ep.poll(0), [])
+            os.write(w, "z")
+            self.assertEquals(ep.poll(0), [(r, select.EPOLLIN)])
+            buf = array.array('i', [0] * 4)
+            self.assertEquals(ep.poll_into(buf, 0), 1)
+            self.assertEquals(list(buf[:2]), [r, select.EPOLLIN])
+            # events dropped from the mask are no longer reported
+            ep.modify(r, select.EPOLLOUT)
+            t = time.time()
+            self.assertEquals(ep.poll(0.2), [])
+            self.assert_(time.time() - t >= 0.15)
+            ep.unregister(r)
+            self.assertEquals(ep.poll(0), [])
+
+            # a full batch takes turns
+            for r, w in pipes:
+                ep.register(r, select.EPOLLIN)
+                os.write(w, "x")
+            seen = set()
+            for i in range(3):
+                events = ep.poll(0, maxevents=2)
+                self.assertEquals(len(events), 2)
+                self.assert_(ep.pending)
+                seen.update([fd for fd, ev in events])
+            self.assertEquals(seen, set([r for r, w in pipes]))
+            for r, w in pipes:
+                ep.mark_drained(r, select.EPOLLIN)
+            self.assertEquals(ep.poll(0), [])
+            self.failIf(ep.pending)
+        finally:
+            ep.close()
+            for r, w in pipes:
+                os.close(r)
+                os.close(w)
+
+    def test_priority(self):
+        ep = select.epoll()
+        pipes = [os.pipe() for i in range(8)]
+        try:
+            bulk, mid, ctrl = pipes[:6], pipes[6], pipes[7]
+            self.assertRaises(ValueError, ep.register, ctrl[0],
+                              select.EPOLLIN, None, 4)
+            self.assertRaises(ValueError, ep.set_budget, 4, 1)
+            self.assertRaises(ValueError, ep.set_budget, 0, 0)
+            for r, w in bulk:
+                ep.register(r, select.EPOLLIN)
+            ep.register(mid[0], select.EPOLLIN, priority=1)
+            ep.register_many([(ctrl[0], select.EPOLLIN, "ctrl", 3)])
+            # one class at a time: another register() is refused
+            try:
+                ep.register(mid[0], select.EPOLLIN, None, 2)
+            except IOError, e:
+                self.assertEquals(e.errno, errno.EEXIST)
+            else:
+                self.fail("register() in another class didn't raise EEXIST")
+            self.assertEquals(ep.register_many([(ctrl[0], select.EPOLLIN,
+                                                 None, 0)]),
+                              [(ctrl[0], errno.EEXIST)])
+            for r, w in pipes:
+                os.write(w, "x")
+
+            events = ep.poll(0)
+            self.assertEquals(len(events), 8)
+            self.assertEquals(events[:2], [("ctrl", select.EPOLLIN),
+                                           (mid[0], select.EPOLLIN)])
+            self.assertEquals(ep.poll(0, maxevents=2),
+                              [("ctrl", select.EPOLLIN),
+                               (mid[0], select.EPOLLIN)])
+            self.assertEquals(ep.set_budget(0, 2), -1)
+            self.assertEquals(len(ep.poll(0)), 4)
+            self.assertEquals(ep.set_budget(3, 1), -1)
+            buf = array.array('i', [0] * 8)
+            self.assertEquals(ep.poll_into(buf, 0), 4)
+            self.assertEquals(list(buf[:4]), [ctrl[0], select.EPOLLIN,
+                                              mid[0], select.EPOLLIN])
+
+            ep.unregister(ctrl[0])
+            ep.unregister(mid[0])
+            self.assertEquals(len(ep.poll(0)), 2)
+            ep.set_budget(0, -1)
+            self.assertEquals(len(ep.poll(0)), 6)
+        finally:
+            ep.close()
+            for r, w in pipes:
+                os.close(r)
+                os.close(w)
+
+    def test_priority_wakeup(self):
+        for deferred in (False, True):
+            ep = select.epoll(deferred=deferred)
+            r, w = os.pipe()
+            r2, w2 = os.pipe()
+            try:
+                ep.register(r, select.EPOLLIN, priority=2)
+                ep.register(r2, select.EPOLLIN)
+                t = threading.Timer(0.1, os.write, (w, "x"))
+                t.start()
+                self.assertEquals(ep.poll(5), [(r, select.EPOLLIN)])
+                t.join()
+                # a new class, in one flush in deferred mode
+                ep.unregister(r)
+                ep.register(r, select.EPOLLIN, priority=1)
+                os.write(w2, "x")
+                self.assertEquals(ep.poll(0), [(r, select.EPOLLIN),
+                                               (r2, select.EPOLLIN)])
+            finally:
+                ep.close()
+                for fd in (r, w, r2, w2):
+                    os.close(fd)
+
+    def test_run(self):
+        ep = select.epoll()
+        pipes = [os.pipe() for i in range(3)]
+        try:
+            (r1, w1), (r2, w2), (r3, w3) = pipes
+            calls = []
+
+            def handler(fd, other=None):
+                def handle(events):
+                    calls.append((fd, events))
+                    os.read(fd, 1)
+                    if other is not None and other in ep:
+                        ep.unregister(other)
+                    if len(calls) == 1:
+                        ep.stop()
+                return handle
+
+            ep.register(r1, select.EPOLLIN, data=handler(r1, r2))
+            ep.register(r2, select.EPOLLIN, data=handler(r2, r1))
+            os.write(w1, "x")
+            os.write(w2, "x")
+            # the first handler unregisters the other fd, which isn't
+            # dispatched although it is in the same batch
+            self.assertEquals(ep.run(), 1)
+            self.assertEquals(len(calls), 1)
+            self.assertEquals(calls[0][1], select.EPOLLIN)
+
+            t = time.time()
+            self.assertEquals(ep.run(until=t + 0.1), 0)
+            self.assert_(time.time() - t >= 0.09)
+
+            # a signal whose handler doesn't raise doesn't end the wait
+            old = signal.signal(signal.SIGALRM, lambda *args: None)
+            try:
+                signal.setitimer(signal.ITIMER_REAL, 0.02)
+                t = time.time()
+                self.assertEquals(ep.run(until=t + 0.1), 0)
+                self.assert_(time.time() - t >= 0.09)
+            finally:
+                signal.setitimer(signal.ITIMER_REAL, 0)
+                signal.signal(signal.SIGALRM, old)
+
+            def fail(events):
+                raise ValueError(events)
+            ep.register(r3, select.EPOLLIN, data=fail)
+            os.write(w3, "x")
+            self.assertRaises(ValueError, ep.run, time.time() + 5)
+            ep.modify(r3, select.EPOLLIN, data=lambda events: ep.run())
+            self.assertRaises(RuntimeError, ep.run, time.time() + 5)
+            ep.unregister(r3)
+            ep.register(r3, select.EPOLLIN)
+            self.assertRaises(TypeError, ep.run, time.time() + 5)
+            ep.unregister(r3)
+            os.read(r3, 1)
+
+            # stop() from another thread wakes run() up
+            stopper = threading.Timer(0.1, ep.stop)
+            stopper.start()
+            t = time.time()
+            self.assertEquals(ep.run(until=t + 5), 0)
+            self.assert_(time.time() - t < 1)
+            stopper.join()
+            stopper = threading.Timer(0.1, ep.stop)
+            stopper.start()
+            t = time.time()
+            self.assertEquals(ep.run(), 0)
+            self.assert_(time.time() - t < 1)
+            stopper.join()
+            # the wakeup isn't an event
+            self.assertEquals(ep.poll(0), [])
+            stopper = threading.Timer(0.1, ep.stop)
+            stopper.start()
+            writer = threading.Timer(0.2, os.write, (w3, "x"))
+            writer.start()
+            ep.register(r3, select.EPOLLIN, data=fail)
+            self.assertEquals(ep.run(until=time.time() + 5), 0)
+            stopper.join()
+            writer.join()
+        finally:
+            ep.close()
+            for r, w in pipes:
+                os.close(r)
+                os.close(w)
+
+    def test_run_batch(self):
+        ep = select.epoll()
+        pipes = [os.pipe() for i in range(6)]
+        try:
+            calls = []
+
+            def handler(name, others):
+                def handle(events):
+                    self.assert_(isinstance(events, array.array))
+                    calls.append((name, sorted(zip(events[::2],
+                                                   events[1::2]))))
+                    for fd in events[::2]:
+                        os.read(fd, 1)
+                    for fd in others:
+                        if fd in ep:
+                            ep.unregister(fd)
+                    if len(calls) == 2:
+                        ep.stop()
+                return handle
+
+            a = [r for r, w in pipes[:4]]
+            b = [r for r, w in pipes[4:]]
+            ha, hb = handler("a", []), handler("b", [])
+            for fd in a:
+                ep.register(fd, select.EPOLLIN, data=ha)
+            ep.register_many([(fd, select.EPOLLIN, hb) for fd in b])
+            for r, w in pipes:
+                os.write(w, "x")
+            self.assertEquals(ep.run(batch=True), 2)
+            calls.sort()
+            self.assertEquals(calls,
+                [("a", [(fd, select.EPOLLIN) for fd in sorted(a)]),
+                 ("b", [(fd, select.EPOLLIN) for fd in sorted(b)])])
+
+            # a handler that unregisters the other's fds takes its turn
+            del calls[:]
+            ha, hb = handler("a", b), handler("b", a)
+            for fd in a:
+                ep.modify(fd, select.EPOLLIN, data=ha)
+            for fd in b:
+                ep.modify(fd, select.EPOLLIN, data=hb)
+            for r, w in pipes:
+                os.write(w, "x")
+            self.assertEquals(ep.run(until=time.time() + 0.2, batch=True), 1)
+            self.assertEquals(len(calls), 1)
+        finally:
+            ep.close()
+            for r, w in pipes:
+                os.close(r)
+                os.close(w)
+
+    def test_spin(self):
+        ep = select.epoll()
+        r, w = os.pipe()
+        try:
+            self.assertRaises(ValueError, ep.set_spin, -1)
+            self.assertEquals(ep.set_spin(500), 0)
+            ep.register(r, select.EPOLLIN)
+            os.write(w, "x")
+            self.assertEquals(ep.poll(1), [(r, select.EPOLLIN)])
+            self.assertEquals((ep.spin_hits, ep.spin_misses), (1, 0))
+            os.read(r, 1)
+            t = time.time()
+            self.assertEquals(ep.poll(0.05), [])
+            self.assert_(time.time() - t >= 0.04)
+            self.assertEquals((ep.spin_hits, ep.spin_misses), (1, 1))
+            # nothing to spin for without a timeout
+            self.assertEquals(ep.poll(0), [])
+            self.assertEquals((ep.spin_hits, ep.spin_misses), (1, 1))
+            threading.Timer(0.05, os.write, (w, "x")).start()
+            self.assertEquals(ep.poll(5), [(r, select.EPOLLIN)])
+            self.assertEquals(ep.spin_misses, 2)
+            self.assertEquals(ep.set_spin(0), 500)
+
+            try:
+                ep.set_busy_poll(10)
+            except IOError, e:
+                # kernels before 6.9, or no busy polling configured
+                self.assert_(e.errno in (errno.ENOTTY, errno.EINVAL,
+                                         errno.EPERM), e)
+            else:
+                self.assertEquals(ep.get_busy_poll(), (10, 64, False))
+        finally:
+            ep.close()
+            os.close(r)
+            os.close(w)
+
+
 def test_main():
     if hasattr(select, "epoll"):
         test_support.run_unittest(TestEPoll)
@@ -0,0 +1,348 @@
+"""
+Tests for the poll object.
+"""
+import os
+import errno
+import signal
+import threading
+import time
+import select_backport as select
+import unittest
+
+
+class TestPoll(unittest.TestCase):
+
+    def setUp(self):
+        self.fds = []
+
+    def tearDown(self):
+        for fd in self.fds:
+            os.close(fd)
+
+    def _pipe(self):
+        rfd, wfd = os.pipe()
+        self.fds.extend((rfd, wfd))
+        return rfd, wfd
+
+    def test_register_modify_unregister(self):
+        pipes = [self._pipe() for i in range(20)]
+        p = select.poll()
+        for rfd, wfd in pipes:
+            p.register(rfd, select.POLLIN)
+            p.register(wfd)
+        for rfd, wfd in pipes[::2]:
+            p.unregister(wfd)
+            p.modify(rfd, select.POLLIN | select.POLLOUT)
+        self.assertRaises(KeyError, p.unregister, pipes[0][1])
+        self.assertRaises(IOError, p.modify, pipes[0][1], select.POLLIN)
+
+        events = p.poll(0)
+        events.sort()
+        expected = [(wfd, select.POLLOUT) for rfd, wfd in pipes[1::2]]
+        self.assertEqual(events, sorted(expected))
+
+        os.write(pipes[0][1], "x")
+        p.register(pipes[1][1], select.POLLIN)
+        events = p.poll(0)
+        events.sort()
+        expected = [(pipes[0][0], select.POLLIN)]
+        expected += [(wfd, select.POLLOUT) for rfd, wfd in pipes[3::2]]
+        self.assertEqual(events, sorted(expected))
+
+    def test_huge_fd(self):
+        # past any descriptor that can be open: no index, POLLNVAL
+        rfd, wfd = self._pipe()
+        p = select.poll()
+        p.register(10 ** 9)
+        p.register(wfd, select.POLLOUT)
+        events = p.poll(0)
+        events.sort()
+        self.assertEqual(events, [(wfd, select.POLLOUT),
+                                  (10 ** 9, select.POLLNVAL)])
+        p.modify(10 ** 9, select.POLLOUT)
+        p.unregister(10 ** 9)
+        self.assertRaises(KeyError, p.unregister, 10 ** 9)
+        self.assertEqual(p.poll(0), [(wfd, select.POLLOUT)])
+
+    def test_objects(self):
+        rfd, wfd = self._pipe()
+        reader = os.fdopen(os.dup(rfd))
+        self.fds.append(os.dup(wfd))
+        p = select.poll(objects=True)
+        p.register(reader, select.POLLIN)
+        p.register(wfd, select.POLLOUT, data="writer")
+        p.register(self.fds[-1], select.POLLOUT)
+        events = p.poll(0)
+        events.sort()
+        self.assertEqual(events, [(self.fds[-1], select.POLLOUT),
+                                  ("writer", select.POLLOUT)])
+        os.write(wfd, "x")
+        p.unregister(wfd)
+        p.unregister(self.fds[-1])
+        self.assertEqual(p.poll(0), [(reader, select.POLLIN)])
+        p.unregister(reader)
+        reader.close()
+
+        p = select.poll()
+        p.register(rfd, select.POLLIN, data=p)
+        self.assertEqual(p.poll(0), [(p, select.POLLIN)])
+        p.register(rfd, select.POLLIN)
+        self.assertEqual(p.poll(0), [(rfd, select.POLLIN)])
+
+    def test_register_while_polling(self):
+        rfd, wfd = self._pipe()
+        p = select.poll()
+        p.register(rfd, select.POLLIN)
+        result = []
+        t = threading.Thread(target=lambda: result.append(p.poll(2000)))
+        t.start()
+        time.sleep(0.05)
+        p.register(wfd, select.POLLOUT)
+        self.assertRaises(RuntimeError, p.poll, 0)
+        os.write(wfd, "x")
+        t.join()
+        self.assertEqual(result, [[(rfd, select.POLLIN)]])
+        events = p.poll(0)
+        events.sort()
+        self.assertEqual(events, [(rfd, select.POLLIN),
+                                  (wfd, select.POLLOUT)])
+
+    def test_ppoll(self):
+        if not hasattr(select.poll(), "ppoll"):
+            return
+        rfd, wfd = self._pipe()
+        p = select.poll()
+        p.register(rfd, select.POLLIN)
+        p.register(wfd, select.POLLOUT)
+        self.assertEqual(p.ppoll(0), [(wfd, select.POLLOUT)])
+
+        os.write(wfd, "x")
+        events = p.ppoll(None, [])
+        events.sort()
+        self.assertEqual(events, [(rfd, select.POLLIN),
+                                  (wfd, select.POLLOUT)])
+
+        p.unregister(wfd)
+        os.read(rfd, 1)
+        now = time.time()
+        self.assertEqual(p.ppoll(0.5), [])
+        self.assertEqual(p.ppoll(1e-6, [signal.SIGUSR1]), [])
+        self.failIf(time.time() - now > 0.1)
+        os.write(wfd, "x")
+        self.assertEqual(p.ppoll(-1.5), [(rfd, select.POLLIN)])
+
+    def test_ppoll_sigmask(self):
+        if not hasattr(select.poll(), "ppoll"):
+            return
+        rfd, wfd = self._pipe()
+        p = select.poll()
+        p.register(rfd, select.POLLIN)
+        self.assertRaises(ValueError, p.ppoll, 0, [0])
+        self.assertRaises(TypeError, p.ppoll, 0, 1)
+
+        fired = []
+        old = signal.signal(signal.SIGALRM, lambda *args: fired.append(1))
+        try:
+            signal.setitimer(signal.ITIMER_REAL, 0.05)
+            try:
+                p.ppoll(2000, [signal.SIGALRM])
+            except select.error, e:
+                self.assertEqual(e.args[0], errno.EINTR)
+            else:
+                self.fail("ppoll() wasn't interrupted")
+            self.assertEqual(fired, [1])
+        finally:
+            signal.setitimer(signal.ITIMER_REAL, 0)
+            signal.signal(signal.SIGALRM, old)
+
+    def test_submillisecond_timeout(self):
+        # poll() takes fractions of a millisecond and rounds them up, on
+        # both backends
+        rfd, wfd = self._pipe()
+        for threshold in (0, 1):
+            p = select.poll(threshold=threshold)
+            p.register(rfd, select.POLLIN)
+            now = time.time()
+            for i in range(50):
+                self.assertEqual(p.poll(0.4), [])
+            elapsed = time.time() - now
+            self.failIf(elapsed < 50 * 0.0004, elapsed)
+            self.failIf(elapsed > 1, elapsed)
+
+    def test_pollscan(self):
+        # every scan routine must report the same entries, including ones
+        # in the partial block at the end of the array
+        p = select.poll()
+        pipes = [self._pipe() for i in range(37)]
+        for rfd, wfd in pipes:
+            p.register(rfd, select.POLLIN)
+        for i in (0, 7, 8, 15, 16, 31, 36):
+            os.write(pipes[i][1], "x")
+        expected = [(pipes[i][0], select.POLLIN)
+                    for i in (0, 7, 8, 15, 16, 31, 36)]
+        expected.sort()
+
+        current = select._pollscan()
+        try:
+            for name in ("scalar", "sse2", "avx2"):
+                try:
+                    select._pollscan(name)
+                except ValueError:
+                    continue
+                self.assertEqual(select._pollscan(), name)
+                events = p.poll(0)
+                events.sort()
+                self.assertEqual(events, expected)
+        finally:
+            select._pollscan(current)
+        self.assertRaises(ValueError, select._pollscan, "mmx")
+
+    def test_epoll_backend(self):
+        p = select.poll(threshold=8)
+        pipes = [self._pipe() for i in range(10)]
+        for rfd, wfd in pipes:
+            p.register(rfd, select.POLLIN)
+        for i in (1, 4, 9):
+            os.write(pipes[i][1], "x")
+        expected = [(pipes[i][0], select.POLLIN) for i in (1, 4, 9)]
+        self.assertEqual(p.stats()["backend"], "poll")
+
+        events = p.poll(0)
+        events.sort()
+        self.assertEqual(events, expected)
+        stats = p.stats()
+        if stats["backend"] == "poll":
+            return                      # no epoll on this platform
+        self.assertEqual(stats["migrations"], 1)
+        self.assertEqual(stats["registered"], 10)
+
+        # changes go to both the registry and the epoll instance
+        p.modify(pipes[4][0], select.POLLOUT)
+        p.unregister(pipes[9][0])
+        p.register(pipes[9][1], select.POLLOUT)
+        events = p.poll(0)
+        events.sort()
+        self.assertEqual(events, [(pipes[1][0], select.POLLIN),
+                                  (pipes[9][1], select.POLLOUT)])
+        if hasattr(p, "ppoll"):
+            events = p.ppoll(0.5)
+            events.sort()
+            self.assertEqual(events, [(pipes[1][0], select.POLLIN),
+                                      (pipes[9][1], select.POLLOUT)])
+
+        # back to poll(2) at half the threshold
+        for rfd, wfd in pipes[2:8]:
+            p.unregister(rfd)
+        self.assertEqual(p.stats()["registered"], 4)
+        events = p.poll(0)
+        events.sort()
+        self.assertEqual(events, [(pipes[1][0], select.POLLIN),
+                                  (pipes[9][1], select.POLLOUT)])
+        stats = p.stats()
+        self.assertEqual(stats["backend"], "poll")
+        self.assertEqual(stats["reverts"], 1)
+
+    def test_epoll_closed(self):
+        # epoll refuses a closed descriptor; poll() reports POLLNVAL
+        p = select.poll(threshold=4)
+        pipes = [self._pipe() for i in range(4)]
+        for rfd, wfd in pipes:
+            p.register(rfd, select.POLLIN)
+        p.poll(0)
+        if p.stats()["backend"] == "poll":
+            return                      # no epoll on this platform
+        fd = os.dup(pipes[0][0])
+        p.register(fd, select.POLLIN)
+        os.close(fd)
+        p.modify(fd, select.POLLIN)
+        self.assertEqual(p.poll(5000), [(fd, select.POLLNVAL)])
+        self.assertEqual(p.stats()["backend"], "poll")
+        # back to epoll once it is gone
+        p.unregister(fd)
+        self.assertEqual(p.poll(0), [])
+        self.assertEqual(p.stats()["backend"], "epoll")
+
+    def test_epoll_fork(self):
+        # a child changing the registry leaves the parent's epoll alone
+        p = select.poll(threshold=4)
+        pipes = [self._pipe() for i in range(4)]
+        for rfd, wfd in pipes:
+            p.register(rfd, select.POLLIN)
+        p.poll(0)
+        if p.stats()["backend"] == "poll":
+            return                      # no epoll on this platform
+        pid = os.fork()
+        if pid == 0:
+            try:
+                p.unregister(pipes[0][0])
+                p.poll(0)
+            finally:
+                os._exit(0)
+        os.waitpid(pid, 0)
+        os.write(pipes[0][1], "x")
+        self.assertEqual(p.poll(1000), [(pipes[0][0], select.POLLIN)])
+
+    def test_epoll_refused(self):
+        # epoll doesn't take regular files; poll(2) reports them readable
+        f = open(__file__)
+        try:
+            rfd, wfd = self._pipe()
+            p = select.poll(threshold=2)
+            p.register(rfd, select.POLLIN)
+            p.register(f, select.POLLIN)
+            self.assertEqual(p.poll(0), [(f.fileno(), select.POLLIN)])
+            stats = p.stats()
+            self.assertEqual(stats["backend"], "poll")
+            self.assertEqual(stats["migrations"], 0)
+            p.unregister(f)
+            p.register(wfd, select.POLLIN)
+            self.assertEqual(p.poll(0), [])
+            self.assertEqual(p.stats()["migrations"], 1)
+        finally:
+            f.close()
+
+        p = select.poll(threshold=0)
+        p.register(rfd, select.POLLIN)
+        p.register(wfd, select.POLLOUT)
+        p.poll(0)
+        self.assertEqual(p.stats()["backend"], "poll")
+        self.assertRaises(ValueError, select.poll, threshold=-1)
+
+        old = select.set_poll_threshold(1)
+        try:
+            p = select.poll()
+            self.assertEqual(p.stats()["threshold"], 1)
+        finally:
+            self.assertEqual(select.set_poll_threshold(old), 1)
+
+    def test_gil_threshold(self):
+        rfd, wfd = os.pipe()
+        p = select.poll()
+        p.register(rfd, select.POLLIN)
+        p.register(wfd, select.POLLOUT)
+        old = select.set_gil_threshold(0.0001)
+        try:
+            self.assertEqual(old, 0)
+            self.assertEqual(p.poll(0), [(wfd, select.POLLOUT)])
+            self.assertEqual(p.poll(0.05), [(wfd, select.POLLOUT)])
+            self.assertEqual(select.select([rfd], [wfd], [], 0),
+                             ([], [wfd], []))
+            self.assertAlmostEqual(select.set_gil_threshold(-5), 0.0001)
+            self.assertEqual(p.poll(0), [(wfd, select.POLLOUT)])
+            self.assertRaises(ValueError, select.set_gil_threshold, 1)
+        finally:
+            self.assertEqual(select.set_gil_threshold(old), -1)
+            os.close(rfd)
+            os.close(wfd)
+
+
+def test_suite():
+    suite = unittest.TestSuite()
+    if hasattr(select, "poll"):
+        suite.addTest(unittest.makeSuite(TestPoll))
+    else:
+        print "No select_backport.poll"
+    return suite
+
+if __name__ == "__main__":
+    unittest.main(defaultTest="test_suite")
@@ -1,3 +1,7 @@
+import os
+import errno
+import resource
+import signal
 import select_backport
 import select
 import unittest
@@ -10,6 +14,127 @@ class TestSelectBackport(unittest.TestCase):
         if hasattr(select, "poll"):
             self.assert_(select_backport.poll is select.poll)
 
+    def test_above_fd_setsize(self):
+        high = 2048
+        soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+        if hard != resource.RLIM_INFINITY and hard <= high:
+            return
+        rfd, wfd = os.pipe()
+        try:
+            if soft <= high:
+                resource.setrlimit(resource.RLIMIT_NOFILE, (high + 1, hard))
+            os.dup2(rfd, high)
+            self.assertEqual(select_backport.select([high], [], [], 0),
+                             ([], [], []))
+            os.write(wfd, "x")
+            self.assertEqual(
+                select_backport.select([high, rfd], [wfd], [], 0),
+                ([high, rfd], [wfd], []))
+            self.assertEqual(
+                select_backport.select([high, rfd, high], [], [wfd], 0),
+                ([high, rfd, high], [], []))
+            self.assertRaises(ValueError, select_backport.select,
+                              [2 ** 30], [], [], 0)
+        finally:
+            os.close(rfd)
+            os.close(wfd)
+            try:
+                os.close(high)
+            except OSError:
+                pass
+            resource.setrlimit(resource.RLIMIT_NOFILE, (soft, hard))
+
+    def test_fdset(self):
+        rfd, wfd = os.pipe()
+        reader = os.fdopen(rfd)
+        try:
+            rset = select_backport.FdSet([rfd, reader])
+            wset = select_backport.FdSet()
+            wset.add(wfd)
+            self.assertEqual(len(rset), 1)
+            self.assert_(rfd in rset)
+            self.assert_(reader in rset)
+            self.assert_(wfd not in rset)
+
+            self.assertEqual(select_backport.select(rset, wset, [], 0),
+                             ([], [wfd], []))
+            os.write(wfd, "x")
+            self.assertEqual(select_backport.select(rset, [wfd], rset, 0),
+                             ([reader], [wfd], []))
+
+            rset.add(rfd)
+            self.assertEqual(select_backport.select(rset, [], [], 0),
+                             ([rfd], [], []))
+            rset.discard(reader)
+            wset.discard(wfd)
+            wset.discard(wfd)
+            self.assertEqual(len(rset) + len(wset), 0)
+            self.assertEqual(select_backport.select(rset, wset, [], 0),
+                             ([], [], []))
+            rset.add(rfd)
+            rset.clear()
+            self.assertEqual(len(rset), 0)
+            self.assertRaises(TypeError, rset.add, "foo")
+        finally:
+            reader.close()
+            os.close(wfd)
+
+    def test_select_bits(self):
+        rfd, wfd = os.pipe()
+        try:
+            r, w, x = select_backport.select_bits([rfd], [wfd], [rfd], 0)
+            self.assertEqual(len(r), len(w))
+            self.assertEqual(select_backport.bits_to_list(r), [])
+            self.assertEqual(select_backport.bits_to_list(w), [wfd])
+            self.assert_(select_backport.bits_isset(w, wfd))
+            self.failIf(select_backport.bits_isset(w, rfd))
+            self.failIf(select_backport.bits_isset(w, 100000))
+            self.failIf(select_backport.bits_isset(x, -1))
+
+            os.write(wfd, "x")
+            r, w, x = select_backport.select_bits(
+                select_backport.FdSet([rfd]), [], [], 0)
+            self.assertEqual(select_backport.bits_to_list(r), [rfd])
+            self.assertEqual(select_backport.bits_to_list(w), [])
+
+            self.assertEqual(select_backport.select_bits([], [], [], 0),
+                             ("", "", ""))
+            self.assertRaises(ValueError, select_backport.bits_to_list,
+                              "abc")
+        finally:
+            os.close(rfd)
+            os.close(wfd)
+
+    def test_pselect(self):
+        if not hasattr(select_backport, "pselect"):
+            return
+        rfd, wfd = os.pipe()
+        fired = []
+        old = signal.signal(signal.SIGALRM, lambda *args: fired.append(1))
+        try:
+            self.assertEqual(select_backport.pselect([rfd], [wfd], [], 0),
+                             ([], [wfd], []))
+            self.assertEqual(
+                select_backport.pselect([rfd], [], [], 1e-9, []),
+                ([], [], []))
+            self.assertRaises(ValueError, select_backport.pselect,
+                              [rfd], [], [], 0, [-1])
+
+            signal.setitimer(signal.ITIMER_REAL, 0.05)
+            try:
+                select_backport.pselect([rfd], [], [], 2,
+                                        [signal.SIGALRM])
+            except select_backport.error, e:
+                self.assertEqual(e.args[0], errno.EINTR)
+            else:
+                self.fail("pselect() wasn't interrupted")
+            self.assertEqual(fired, [1])
+        finally:
+            signal.setitimer(signal.ITIMER_REAL, 0)
+            signal.signal(signal.SIGALRM, old)
+            os.close(rfd)
+            os.close(wfd)
+
 
 def test_suite():
     suite = unittest.TestSuite()